@@ -0,0 +1,123 @@
+/*
+ * coroutine.h
+ *
+ * Copyright (c) 2012, Thomas Buck <xythobuz@me.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+/*
+ * Stackless coroutines, in the style of protothreads.
+ * A coroutine is a function that is called again and again by tasks()
+ * and continues where it stopped waiting the last time. Local variables
+ * are NOT preserved across a wait, use static or global variables.
+ * Don't use a switch statement in a coroutine body.
+ *
+ *     Coroutine foo;
+ *     uint8_t fooThread(Coroutine *c) {
+ *         CR_BEGIN(c);
+ *         sendRequest();
+ *         CR_WAIT_TIMEOUT(c, gotReply, 2000);
+ *         if (CR_TIMED_OUT(c)) { ... }
+ *         CR_END(c);
+ *     }
+ *     crStart(&foo, fooThread);
+ *
+ * The coroutines run from an event task, not in every loop iteration.
+ * Whatever makes a condition true (a packet handler, an ISR) has to
+ * call crWake(), then all waiting conditions are checked again. For
+ * CR_WAIT_TIMEOUT a scheduler Timer wakes them at the deadline, so the
+ * MCU can sleep in tickless mode while a coroutine waits.
+ */
+#ifndef _coroutine_h
+#define _coroutine_h
+
+#include <time.h>
+
+#define CR_WAITING 0
+#define CR_DONE 1
+
+typedef struct Coroutine Coroutine;
+typedef uint8_t (*CoroutineFunc)(Coroutine *c); // Returns CR_WAITING or CR_DONE
+
+struct Coroutine {
+    CoroutineFunc func;
+    Coroutine *next; // List of running coroutines
+    tick_t deadline; // For CR_WAIT_TIMEOUT
+    uint16_t line; // Where to continue, 0 to start from the beginning
+    uint8_t flags;
+};
+
+#define CR_FLAG_RUNNING 0x01
+#define CR_FLAG_TIMEOUT 0x02
+#define CR_FLAG_DEADLINE 0x04 // Waiting in CR_WAIT_TIMEOUT
+#define CR_FLAG_YIELD 0x08 // Run again in the next loop
+
+#define CR_BEGIN(c) switch ((c)->line) { case 0:
+
+#define CR_END(c) } (c)->line = 0; return CR_DONE
+
+// Stop the coroutine. It is called from the start the next time.
+#define CR_EXIT(c) do { (c)->line = 0; return CR_DONE; } while (0)
+
+// Give the other tasks a chance to run, continue in the next loop
+#define CR_YIELD(c) do {                 \
+    (c)->flags |= CR_FLAG_YIELD;         \
+    (c)->line = __LINE__; return CR_WAITING; \
+    case __LINE__:;                      \
+} while (0)
+
+// cond is checked again after crWake()
+#define CR_WAIT_UNTIL(c, cond) do {      \
+    (c)->line = __LINE__;                \
+    case __LINE__:                       \
+    if (!(cond)) return CR_WAITING;      \
+} while (0)
+
+// Wait until cond is true or ms milliseconds are over.
+// Afterwards CR_TIMED_OUT(c) tells which one happened.
+#define CR_WAIT_TIMEOUT(c, cond, ms) do {                           \
+    (c)->deadline = getSystemTime() + (ms);                         \
+    (c)->flags &= ~CR_FLAG_TIMEOUT;                                 \
+    (c)->flags |= CR_FLAG_DEADLINE;                                 \
+    (c)->line = __LINE__;                                           \
+    case __LINE__:                                                  \
+    if (!(cond)) {                                                  \
+        if ((int32_t)(getSystemTime() - (c)->deadline) < 0)         \
+            return CR_WAITING;                                      \
+        (c)->flags |= CR_FLAG_TIMEOUT;                              \
+    }                                                               \
+    (c)->flags &= ~CR_FLAG_DEADLINE;                                \
+} while (0)
+
+#define CR_TIMED_OUT(c) ((c)->flags & CR_FLAG_TIMEOUT)
+
+// Start running func as coroutine. The Coroutine struct is owned by the
+// caller and must stay valid until func returned CR_DONE.
+uint8_t crStart(Coroutine *c, CoroutineFunc func); // 0 on success, 1 if already running
+void crStop(Coroutine *c); // Does nothing if not running
+uint8_t crIsRunning(Coroutine *c);
+void crWake(void); // A condition may have become true. Can also be called from an ISR
+
+#endif
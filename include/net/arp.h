@@ -33,22 +33,26 @@
 #include <net/mac.h>
 #include <net/ipv4.h>
 #include <time.h>
+#include <slab.h>
 #include <net/controller.h>
 
 #define ARPTableTimeToLive 300000 // Keep unused Cache entries for 5 Minutes
-#define ARPTableTimeToRetry 5000 // Request new answer every 5 seconds
+#define ARPTableTimeToRetry 5000 // Forget unanswered requests after 5 seconds
 
 // Defined here to allow "userspace" to inspect arp cache.
 typedef struct ARPTableEntry ARPTableEntry;
 struct ARPTableEntry {
     IPv4Address   ip;
     uint8_t       mac[6];
-    time_t        time;
+    uint8_t       iface; // Learned on netInterfaces[iface]
+    tick_t        time;
     ARPTableEntry *next;
 };
 
+#define ARPAnyInterface 0xFF // iface of the broadcast entry
+
 #define ARPPacketSize 22 // Without header
-#define ARPOffset MACPreambleSize + 6
+#define ARPOffset 6 // Fixed header, from packetL3()
 #define ARPOperationOffset 0
 #define ARPSourceMacOffset 2
 #define ARPSourceIpOffset 8
@@ -56,6 +60,7 @@ struct ARPTableEntry {
 #define ARPDestinationIpOffset 18
 
 extern ARPTableEntry *arpTable;
+extern Slab arpSlab;
 
 void arpInit(void);
 uint8_t arpProcessPacket(Packet *p); // Processes all received ARP Packets
@@ -65,6 +70,9 @@ uint8_t arpProcessPacket(Packet *p); // Processes all received ARP Packets
 
 // Searches in ARP Table. If entry is found, return non-alloced buffer with mac address.
 // If there is no entry, issue arp packet and return NULL. Try again later.
-uint8_t *arpGetMacFromIp(IPv4Address ip);
+// ip is reached over interface n, see netRoute().
+uint8_t *arpGetMacFromIp(NetInterface *n, IPv4Address ip);
+// Is d reached directly over n, or through its gateway
+uint8_t isIpInThisNetwork(NetInterface *n, uint8_t *d);
 
 #endif
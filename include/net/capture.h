@@ -0,0 +1,84 @@
+/*
+ * capture.h
+ *
+ * Copyright (c) 2012, Thomas Buck <xythobuz@me.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+/*
+ * Mirrors received and sent frames into a ring buffer, from where they
+ * are streamed out as pcap records that Wireshark can read. Either as a
+ * complete pcap file over the UART (set DEBUG to 0 everywhere), or as
+ * records in UDP datagrams to a host running pcapReceiver.
+ * Loopback packets never reach the MAC and are not captured.
+ * Comment out DISABLE_CAPTURE in controller.h to use this.
+ */
+#ifndef _capture_h
+#define _capture_h
+
+#include <stdint.h>
+#include <net/controller.h>
+
+#define CAPTURE_SERIAL 0 // Binary pcap file over the UART
+#define CAPTURE_UDP 1 // pcap records in UDP datagrams, without file header
+
+#define CAPTURE_RX 0
+#define CAPTURE_TX 1
+
+// p->d is the MAC header, direction CAPTURE_RX or CAPTURE_TX.
+// Return 1 to capture the frame.
+typedef uint8_t (*CaptureFilter)(Packet *p, uint8_t direction);
+
+typedef struct {
+    uint16_t captured; // Put into the ring
+    uint16_t dropped; // Ring was full
+    uint16_t sendFailed; // No packet buffer for a datagram, records lost
+} CaptureStats;
+
+#ifndef DISABLE_CAPTURE
+extern uint8_t captureActive;
+extern CaptureStats captureStats;
+
+// Capture frames accepted by filter (NULL for all) until captureStop().
+// Frames are truncated to snapLength (0 for as much as fits).
+// ip and port are only used for CAPTURE_UDP.
+void captureStart(uint8_t output, CaptureFilter filter, uint16_t snapLength,
+        uint8_t *ip, uint16_t port);
+void captureStop(void);
+
+void captureFrame(Packet *p, uint8_t direction); // Call captureHook()
+uint8_t captureHasData(void); // Records waiting in the ring
+void captureSend(void); // Task, streams out the ring
+
+#define captureHook(p, direction) ({        \
+    if (captureActive) {                    \
+        captureFrame((p), (direction));     \
+    }                                       \
+})
+#else
+#define captureHook(p, direction)
+#endif
+
+#endif
@@ -56,23 +56,115 @@
 #define DISABLE_DNS_STRINGS           // Disable DNS Debug Output
 #define DISABLE_DNS_DOMAIN_VALIDATION // Don't check if domains are valid
 // #define DISABLE_NTP                   // Disable NTP.
+// #define DISABLE_HEAP                  // No malloc at all, all memory is static
+// #define DISABLE_NET_STATS             // Don't count packets and drops (stats.h)
+// #define DISABLE_RATE_LIMIT            // Don't shed broadcast, ARP and ICMP floods
+#define DISABLE_CAPTURE               // No pcap capture of frames (capture.h)
 
 // -----------------------------------
 // |            RAM Usage            |
 // -----------------------------------
 
-#define ARPMaxTableSize 10 // This times 14 bytes will be allocated max
 #define BUFFSIZE 80 // General String Buffer Size
 
+// Small structures are kept in fixed slabs, this memory is reserved.
+#define ARPMaxTableSize 10 // This times 17 bytes. Oldest entry is replaced if full.
+#define IPv4MaxQueueSize 3 // Packets waiting for ARP or the MAC, 4 bytes each
+#define IPv4QueueDepthControl 2 // Of these, at most this many per transmit class
+#define IPv4QueueDepthInteractive 2
+#define IPv4QueueDepthBulk 1
+#define UDPMaxHandlers 4 // 6 bytes each
+#define TasksMaxDynamic 2 // Tasks added with addTask(), 28 bytes each
+#define TimersMaxDynamic 2 // Timers added with addTimedTask(), 24 bytes each
+#define EthertypeMaxHandlers 4 // Including IPv4 and ARP, 4 bytes each
+#define IPv4MaxHandlers 4 // Protocols on top of IPv4, including ICMP and UDP
+#define NetMaxInterfaces 2 // 20 bytes each
+#define CaptureRingSize 256 // Captured frames, 8 bytes overhead each
+
+// Packet buffer pool, statically allocated. Each buffer needs
+// sizeof(Packet) bytes in addition to its size. The sizes have to be
+// ascending, received frames bigger than the last class are dropped.
+#define PacketPoolSmallSize 64 // ARP, short ICMP and UDP
+#define PacketPoolSmallCount 2
+#define PacketPoolMediumSize 128 // Ping, NTP
+#define PacketPoolMediumCount 2
+#define PacketPoolLargeSize 320 // Everything else we can handle
+#define PacketPoolLargeCount 1
+#define PacketPoolReserve 1 // Never held by queued transmissions, for RX and ARP
+
+// -----------------------------------
+// |           Rate Limits           |
+// -----------------------------------
+
+// Token buckets, packets per second and burst size. Packets over the limit
+// are dropped before they are processed, so a flood on the wire can not
+// starve the application tasks.
+#define BroadcastRateLimit 20 // Broadcast and multicast frames, except ARP
+#define BroadcastBurst 10
+#define ARPRateLimit 10
+#define ARPBurst 10
+#define ICMPRateLimit 5
+#define ICMPBurst 5
+
 // -----------------------------------
 // |          External API           |
 // -----------------------------------
 
+#define SEGMENT_RAM 0
+#define SEGMENT_FLASH 1
+#define SEGMENT_EEPROM 2
+
+// Payload that is sent behind the data of a Packet, without copying it.
+// Can live in RAM, Flash or EEPROM (memory), see packetAppend().
+typedef struct PacketSegment PacketSegment;
+struct PacketSegment {
+    const uint8_t *d;
+    uint16_t length;
+    uint8_t memory;
+    PacketSegment *next;
+};
+
 typedef struct {
     uint8_t *d;
-    uint16_t dLength;
+    uint16_t dLength; // Without chain
+    PacketSegment *chain; // Sent behind d, NULL for received packets
+    uint32_t time; // getSystemTimeUs() when received
+    uint8_t pool; // Size class, used by packetRelease()
+    uint8_t refs; // References, see packetRetain()
+    uint8_t l3; // Network layer header, from start of buffer
+    uint8_t l4; // Transport layer header, from start of buffer
+    uint8_t iface; // Received on / sent over netInterfaces[iface]
 } Packet;
 
+// Handles a received packet and has to release it.
+// 0 on success, 1 not enough mem, 2 invalid
+typedef uint8_t (*PacketHandler)(Packet *);
+
+// Implemented by every hardware driver, see mac.h
+typedef struct {
+    uint8_t (*initialize)(uint8_t *address); // 0 if success, 1 on error
+    void    (*reset)(void);
+    uint8_t (*linkIsUp)(void); // 0 if down, 1 if up
+    uint8_t (*sendPacket)(Packet *p); // 0 on success, 1 on PHY error
+    uint8_t (*packetsReceived)(void); // number of packets ready
+    Packet *(*getPacket)(void);
+    uint8_t (*hasInterrupt)(void);
+    // Enable an interrupt on the INT line, so it wakes the MCU from sleep.
+    // Returns 1 if that's possible, 0 if the line has to be polled.
+    uint8_t (*enableWakeup)(void);
+    uint8_t segments; // 1 if sendPacket() sends p->chain, else it is copied first
+} MacDriver;
+
+// One network chip with its own addresses
+typedef struct {
+    const MacDriver *driver;
+    uint8_t mac[6];
+    uint8_t ip[4];
+    uint8_t subnet[4];
+    uint8_t gateway[4];
+} NetInterface;
+
+#include <net/packet.h>
 #include <net/mac.h>
 #include <net/ipv4.h>
 // Both includes depend on this Packet definition, so we can include them only now!
@@ -90,14 +182,32 @@ char *timeToString(time_t s);
 char *hexToString(uint64_t s);
 char *hex2ToString(uint64_t s);
 
-void networkInit(uint8_t *mac, uint8_t *ip, uint8_t *subnet, uint8_t *gateway);
+// Initializes the stack with driver as first interface
+void networkInit(const MacDriver *driver, uint8_t *mac, uint8_t *ip, uint8_t *subnet, uint8_t *gateway);
 void networkLoop(void);
 
+extern NetInterface netInterfaces[NetMaxInterfaces];
+extern uint8_t netInterfaceCount;
+
+// Add another interface after networkInit(). The first one added is
+// preferred for routes, the next ones take over if its link is down.
+// 0 on success, 1 if the driver failed or NetMaxInterfaces reached
+uint8_t netInterfaceAdd(const MacDriver *driver, uint8_t *mac, uint8_t *ip, uint8_t *subnet, uint8_t *gateway);
+
+// The interface to send to ip: the first with link up that has ip
+// in its subnet, else the first with link up (via its gateway).
+NetInterface *netRoute(uint8_t *ip);
+
+// Handle frames with this ethertype yourself (replaces IPv4 or ARP, too).
+// NULL removes the handler. 0 on success, 1 if EthertypeMaxHandlers reached
+uint8_t networkRegisterHandler(uint16_t ethertype, PacketHandler handler);
+
 #define IPV4 0x0800
 #define ARP 0x0806
 #define WOL 0x0842
 #define RARP 0x8035
 #define IPV6 0x86DD
+#define VLAN 0x8100
 
 // -----------------------------------
 // |          Dependencies           |
@@ -110,6 +220,10 @@ void networkLoop(void);
 #define DISABLE_ICMP_UDP_MSG
 #endif
 
+#ifdef DISABLE_HEAP
+#define DISABLE_HEAP_LOG
+#endif
+
 #ifdef DISABLE_UDP
 #define DISABLE_UDP_CHECKSUM
 #define DISABLE_DHCP
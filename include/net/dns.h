@@ -41,7 +41,7 @@ typedef struct DnsTableEntry DnsTableEntry;
 struct DnsTableEntry {
 	IPv4Address ip;
 	uint8_t *name;
-	time_t time;
+	tick_t time;
 	uint32_t ttl; // Time To Live in seconds
 	DnsTableEntry *next;
 };
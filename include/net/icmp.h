@@ -33,7 +33,6 @@
 #include <net/mac.h>
 #include <net/ipv4.h>
 
-#define ICMPOffset (MACPreambleSize + IPv4PacketHeaderLength)
 #define ICMPPacketSize 4
 #define ICMPTypeOffset 0
 #define ICMPCodeOffset 1
@@ -48,7 +47,7 @@ void icmpInit(void);
 // p freed afterwards
 uint8_t icmpProcessPacket(Packet *p);
 
-void registerEchoReplyHandler(void (*func)(Packet *)); // func has to free p->d and p
+void registerEchoReplyHandler(void (*func)(Packet *)); // func has to release p
 
 void sendEchoRequest(uint8_t *ip);
 
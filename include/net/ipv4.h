@@ -32,9 +32,12 @@
 
 #include <net/mac.h>
 #include <net/controller.h>
+#include <slab.h>
 
 typedef uint8_t IPv4Address[4];
 
+#define IPv4PacketTosOffset 1
+#define IPv4PacketLengthOffset 2
 #define IPv4PacketFlagsOffset 6
 #define IPv4PacketProtocolOffset 9
 #define IPv4PacketSourceOffset 12
@@ -42,30 +45,61 @@ typedef uint8_t IPv4Address[4];
 #define IPv4PacketHeaderLength 20
 
 #define IPv4MaxPacketSize (MaxPacketSize - IPv4PacketHeaderLength)
+#define IPv4Headroom (MACPreambleSize + IPv4PacketHeaderLength) // In front of payload
+#define IPv4RetryInterval 250 // ms until a queued packet the MAC could not send is tried again
+
+#define IPV4_TOS_DEFAULT 0x00 // Type Of Service, Routine
+
+// Transmit classes, queued packets of a lower number are sent first.
+// Only used inside this stack, they don't change the header.
+// Depth limits are in the RAM Usage section of controller.h.
+#define IPV4_CLASS_CONTROL 0
+#define IPV4_CLASS_INTERACTIVE 1
+#define IPV4_CLASS_BULK 2
+#define IPV4_CLASSES 3
 
 #define ICMP 0x01
 #define IGMP 0x02
 #define TCP 0x06
 #define UDP 0x11
 
-extern IPv4Address ownIpAddress;
-extern IPv4Address subnetmask;
-extern IPv4Address defaultGateway;
-
-void ipv4Init(IPv4Address ip, IPv4Address subnet, IPv4Address gateway);
+// Sets the addresses of interface n
+void ipv4Init(NetInterface *n, IPv4Address ip, IPv4Address subnet, IPv4Address gateway);
+uint8_t isBroadcastIp(NetInterface *n, uint8_t *d);
 
 uint8_t ipv4ProcessPacket(Packet *p);
 // Returns 0 on success, 1 if not enough mem, 2 if packet invalid.
+// Sets p->l4 behind the header, including options.
+
+// Handle this IP protocol yourself (replaces ICMP or UDP, too).
+// NULL removes the handler. 0 on success, 1 if IPv4MaxHandlers reached
+uint8_t ipv4RegisterHandler(uint8_t protocol, PacketHandler handler);
 
 // Gives default values for all fields in the IPv4 Header
 // Also computes checksum, if enabled.
-// Creates Ethernet and IPv4 Header, gets Target MAC, and off we go.
-uint8_t ipv4SendPacket(Packet *p, uint8_t *target, uint8_t protocol);
+// p->d is the payload, with at least IPv4Headroom bytes in front of it.
+// Prepends Ethernet and IPv4 Header, gets Target MAC, and off we go.
+// Sent over netRoute(target), with the addresses of that interface.
+// tos is written into the header as it is. txClass (IPV4_CLASS_...)
+// selects the transmit queue, the packet only goes out directly if
+// nothing of its class or a higher one is waiting.
+uint8_t ipv4SendPacket(Packet *p, uint8_t *target, uint8_t protocol, uint8_t tos, uint8_t txClass);
 
 uint8_t ipv4LastProtocol(void);
 
-void ipv4SendQueue(void); // Send next packet in queue
+extern Slab ipv4QueueSlab;
+
+// Event task, posted when a queued packet may have become sendable
+extern uint8_t ipv4SendEvent;
+void ipv4SendQueue(void); // Send next packet of the highest class
 uint8_t ipv4PacketsToSend(void); // Is something in the queue ready
 uint8_t ipv4PacketsInQueue(void); // Is something in the queue
+// ARP got no answer for ip on netInterfaces[iface], drop the packets waiting for it
+void ipv4DropUnresolved(uint8_t iface, IPv4Address ip);
+
+// Packets sent to one of our own addresses don't go to the MAC. They are
+// queued (in ipv4QueueSlab) and received by this event task instead.
+extern uint8_t ipv4LoopbackEvent;
+void ipv4LoopbackQueue(void);
 
 #endif
@@ -29,7 +29,9 @@
  */
 /*
  * This file defines the standard API implemented by different drivers
- * for eg. the ENC28J60
+ * for eg. the ENC28J60. Every driver exports its functions as MacDriver
+ * (see controller.h), so more than one of them can be linked and used
+ * at the same time, each by its own NetInterface.
  */
 #ifndef _mac_h
 #define _mac_h
@@ -40,20 +42,16 @@
 #define MACDestinationOffset 0
 #define MACSourceOffset 6
 #define MACTypeOffset 12
+#define MACVLANTagSize 4 // IEEE 802.1Q Tag in front of the type
 
 #define MaxPacketSize 1518 // Max EthernetII Packet Size
+#define MACPollInterval 10 // ms, max. sleep if the INT line can't wake us
 
-extern uint8_t ownMacAddress[6];
-
-uint8_t macInitialize(uint8_t *address); // 0 if success, 1 on error
-void    macReset(void);
-uint8_t macLinkIsUp(void); // 0 if down, 1 if up
+extern const MacDriver enc28j60Driver;
+extern const MacDriver encTestDriver;
+extern const MacDriver mrf24wb0maDriver;
 
+// Sends p with the driver of netInterfaces[p->iface].
 uint8_t macSendPacket(Packet *p); // 0 on success, 1 on PHY error
 
-uint8_t macPacketsReceived(void); // number of packets ready
-Packet *macGetPacket(void);
-
-uint8_t macHasInterrupt(void);
-
 #endif
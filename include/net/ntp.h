@@ -28,8 +28,10 @@
  * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 /*
- * A SNTP Implementation that (probably) updates time.h's currentTime
+ * A SNTP Implementation that (probably) updates time.h's wall clock
  * sometime after ntpIssueRequest was successfully called (returned 0).
+ * The first response sets the time, later ones are used to estimate
+ * the frequency error of our crystal and the offset is slewed.
  * Implemented as described in RFC1361 (http://tools.ietf.org/html/rfc1361)
  */
 #ifndef _ntp_h
@@ -39,6 +41,11 @@
 #include <net/udp.h>
 #include <net/controller.h>
 
+#define NTPStepThreshold 1000 // ms, larger offsets are stepped if we're behind
+#define NTPMaxRoundTrip 500 // ms, slower responses are not used to discipline
+#define NTPMinInterval 60000 // ms between samples to estimate the frequency
+#define NTPMaxFrequency 500000 // ppb, max. frequency correction
+
 #ifndef DISABLE_DNS
 extern uint8_t ntpServerDomain[];
 #endif
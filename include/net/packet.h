@@ -0,0 +1,108 @@
+/*
+ * packet.h
+ *
+ * Copyright (c) 2012, Thomas Buck <xythobuz@me.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+/*
+ * Fixed pool of packet buffers in a few size classes. packetAlloc()
+ * returns a Packet with its data buffer directly behind it, so
+ * everything is freed with a single packetRelease(). Both are O(1).
+ * Configure the classes in the RAM Usage section of controller.h.
+ *
+ * Packets are reference counted. packetAlloc() returns one reference,
+ * every function that gets a Packet passed owns one reference and has
+ * to release it (or hand it on). Call packetRetain() to keep a packet
+ * for yourself while passing it on, e.g. to send it again later or to
+ * give it to more than one handler. While a packet is shared
+ * (packetShared()), nobody may modify its data.
+ *
+ * p->d is the start of the data in the buffer. Received frames start at
+ * the beginning of the buffer, the receiving layers only record where
+ * their header starts (l3, l4). When sending, allocate with headroom
+ * and put only your payload into p->d. Every layer then prepends its
+ * header with packetPush(), without copying or reallocating.
+ *
+ * Bigger payloads don't have to be copied into a buffer at all. Append
+ * them as segments (packetAppend()) to a Packet that only holds the
+ * headers, the MAC driver writes them directly into its TX memory.
+ * Segments in RAM have to stay valid until the Packet is released by
+ * the stack. Keep your own reference and wait until !packetShared().
+ */
+#ifndef _packet_h
+#define _packet_h
+
+#include <net/controller.h>
+
+typedef struct {
+    Packet *free; // Stack of free buffers, linked through Packet.d
+    uint16_t size; // Max. dLength
+    uint8_t count; // Buffers in this class
+    uint8_t available; // Free buffers
+    uint8_t minAvailable; // count - minAvailable is the high-water mark
+    uint16_t exhausted; // Allocations that found this class empty
+} PacketPool;
+
+#define PACKETPOOLS 3
+#define PacketMaxLength PacketPoolLargeSize
+
+extern PacketPool packetPools[PACKETPOOLS];
+extern uint16_t packetTooBig; // Allocations bigger than PacketMaxLength
+
+void packetInit(void);
+
+// Packet with dLength bytes, from the smallest class that has a buffer
+// left. NULL if the pool is exhausted or length > PacketMaxLength.
+Packet *packetAlloc(uint16_t length);
+// Same, but p->d starts headroom bytes into the buffer
+Packet *packetAllocHeadroom(uint16_t headroom, uint16_t length);
+Packet *packetRetain(Packet *p); // Returns p, for convenience
+void packetRelease(Packet *p); // Back into the pool after last reference
+#define packetShared(p) ((p)->refs > 1)
+uint8_t packetAvailable(void); // Free buffers in all classes
+uint16_t packetExhausted(void); // Sum of exhausted of all classes
+
+#define packetBuffer(p) ((uint8_t *)((p) + 1)) // Start of the buffer
+#define packetHeadroom(p) ((uint16_t)((p)->d - packetBuffer(p))) // Free in front of d
+#define packetEnd(p) ((p)->d + (p)->dLength) // Behind the last byte
+#define packetL3(p) (packetBuffer(p) + (p)->l3) // Network layer header
+#define packetL4(p) (packetBuffer(p) + (p)->l4) // Transport layer header
+#define packetL4Length(p) ((uint16_t)(packetEnd(p) - packetL4(p)))
+
+void packetAppend(Packet *p, PacketSegment *s); // Add s at the end of the chain
+// Copies p and its chain into a new single buffer with the same l3, l4
+// and iface, and releases p. NULL if no buffer is left (p is released).
+Packet *packetCopy(Packet *p);
+uint16_t packetLength(Packet *p); // dLength and all segments
+uint8_t segmentByte(PacketSegment *s, uint16_t i); // From RAM, Flash or EEPROM
+
+// Prepend n bytes in front of p->d and return the new p->d.
+// Asserts that there is enough headroom.
+uint8_t *packetPush(Packet *p, uint16_t n);
+// Remove n bytes from the front of p->d and return the new p->d.
+uint8_t *packetPull(Packet *p, uint16_t n);
+
+#endif
@@ -0,0 +1,98 @@
+/*
+ * stats.h
+ *
+ * Copyright (c) 2012, Thomas Buck <xythobuz@me.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+/*
+ * Counters for every layer of the stack, like an SNMP MIB. Each drop
+ * path increments the counter for its reason, so you can see where
+ * packets disappear. All counters are uint16_t and wrap around.
+ * Define DISABLE_NET_STATS in controller.h to remove them.
+ */
+#ifndef _stats_h
+#define _stats_h
+
+#include <stdint.h>
+#include <net/controller.h>
+
+// Every layer only has uint16_t members, so it can be read like an array.
+typedef struct {
+    struct {
+        uint16_t rx; // Frames received
+        uint16_t tx; // Frames given to the MAC
+        uint16_t rxError; // Receive failed
+        uint16_t txError; // MAC could not send
+        uint16_t noHandler; // Unknown ethertype
+        uint16_t shed; // Broadcasts over the rate limit
+        uint16_t rxStalled; // Frame left in the MAC, no packet buffer
+    } mac;
+    struct {
+        uint16_t rx;
+        uint16_t tx;
+        uint16_t invalid; // Length, header or version
+        uint16_t checksum;
+        uint16_t fragment; // Not supported
+        uint16_t notForUs;
+        uint16_t noHandler; // Unknown protocol
+        uint16_t unresolved; // Queued, waiting for ARP
+        uint16_t queueFull; // Dropped, no room in queue or buffer reserve
+        uint16_t unreachable; // Dropped from queue, ARP got no answer
+    } ipv4;
+    struct {
+        uint16_t rx;
+        uint16_t tx;
+        uint16_t invalid;
+        uint16_t notForUs; // Requests for other hosts
+        uint16_t noMemory; // No buffer for a request
+        uint16_t shed; // Over the rate limit
+    } arp;
+    struct {
+        uint16_t rx;
+        uint16_t tx;
+        uint16_t invalid;
+        uint16_t checksum;
+        uint16_t noMemory; // No buffer for an echo request
+        uint16_t shed; // Over the rate limit
+    } icmp;
+    struct {
+        uint16_t rx;
+        uint16_t tx;
+        uint16_t invalid;
+        uint16_t checksum;
+        uint16_t noHandler; // Nobody listens on this port
+    } udp;
+} NetStats;
+
+#ifndef DISABLE_NET_STATS
+extern NetStats netStats;
+#define netCount(c) (netStats.c++) // eg. netCount(udp.checksum)
+void netStatsReset(void);
+#else
+#define netCount(c)
+#endif
+
+#endif
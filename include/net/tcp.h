@@ -35,7 +35,6 @@
 #include <net/controller.h>
 
 #define TCPPacketLength 20
-#define TCPOffset (MACPreambleSize + IPv4PacketHeaderLength)
 #define TCPSourceOffset 0 // 16bit
 #define TCPDestinationOffset 2 // 16bit
 #define TCPSeqOffset 4 // 32bit
@@ -56,7 +55,7 @@ uint8_t tcpHandlePacket(Packet *p);
 
 // Overwrites existing handler for this port
 // 0 on succes, 1 on not enough RAM
-// Handler has to free the Packet!
+// Handler has to release the Packet!
 uint8_t tcpRegisterHandler(uint8_t (*handler)(Packet *), uint16_t port);
 
 // Allocate large enough Packet, fill in data, then call this.
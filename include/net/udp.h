@@ -33,8 +33,8 @@
 #include <net/mac.h>
 #include <net/ipv4.h>
 #include <net/controller.h>
+#include <slab.h>
 
-#define UDPOffset (MACPreambleSize + IPv4PacketHeaderLength)
 #define UDPSourceOffset 0
 #define UDPDestinationOffset 2
 #define UDPLengthOffset 4
@@ -42,22 +42,32 @@
 #define UDPDataOffset 8
 
 #define UDPMaxPacketSize (IPv4MaxPacketSize - UDPDataOffset)
+#define UDPHeadroom (IPv4Headroom + UDPDataOffset) // In front of payload
+
+// Packet for length bytes of payload at p->d, with room for all headers
+#define udpAllocPacket(length) packetAllocHeadroom(UDPHeadroom, (length))
 
 extern uint16_t udpRegisteredHandlers;
+extern Slab udpHandlerSlab;
 
 void udpInit(void);
 
 // 0 on success, 1 if not enough mem, 2 invalid
 uint8_t udpHandlePacket(Packet *p);
 
-// Overwrites existing handler for this port
+// More than one handler can listen on the same port, all of them
+// get the Packet. Payload is at packetL4(p) + UDPDataOffset.
 // 0 on succes, 1 on not enough RAM
-// Handler has to free the UdpPacket!
+// Handler has to release the Packet! Don't modify it if packetShared().
 uint8_t udpRegisterHandler(uint8_t (*handler)(Packet *), uint16_t port);
 
-// Allocate large enough Packet, fill in data, then call this.
-// UDP Header will be filled, then the Packet goes into the
+// Allocate Packet with udpAllocPacket(), fill in data (or append segments),
+// then call this.
+// UDP Header will be prepended, then the Packet goes into the
 // IPv4 Transmission Buffer...
-uint8_t udpSendPacket(Packet *p, uint8_t *targetIp, uint16_t targetPort, uint16_t sourcePort);
+// txClass selects the transmit queue (IPV4_CLASS_... in ipv4.h),
+// udpSendPacket() sends as bulk data.
+uint8_t udpSendPacketClass(Packet *p, uint8_t *targetIp, uint16_t targetPort, uint16_t sourcePort, uint8_t txClass);
+#define udpSendPacket(p, targetIp, targetPort, sourcePort) udpSendPacketClass((p), (targetIp), (targetPort), (sourcePort), IPV4_CLASS_BULK)
 
 #endif
@@ -42,4 +42,44 @@ uint8_t isEqualFlash(const uint8_t *d1, const uint8_t *d2, uint16_t l);
 uint8_t isEqualMem(uint8_t *d1, uint8_t *d2, uint16_t l);
 void dumpPacketRaw(Packet *p);
 
+typedef struct {
+    uint16_t type; // Ethertype or IP protocol number
+    PacketHandler handler;
+} ProtocolHandler;
+
+// Sorted by type, so lookups are a binary search
+typedef struct {
+    ProtocolHandler *handlers;
+    uint8_t count;
+    uint8_t size;
+} ProtocolTable;
+
+// Table with room for size handlers. The handlers given at compile time
+// have to be sorted by type:
+//     PROTOCOL_TABLE(ethertypes, 4,
+//         { IPV4, ipv4ProcessPacket },
+//         { ARP, arpProcessPacket }
+//     );
+#define PROTOCOL_TABLE(name, size, ...)                                  \
+    ProtocolHandler name##Handlers[size] = { __VA_ARGS__ };             \
+    ProtocolTable name = { name##Handlers,                              \
+        sizeof((ProtocolHandler[]){ __VA_ARGS__ }) / sizeof(ProtocolHandler), size }
+
+PacketHandler protocolFind(ProtocolTable *t, uint16_t type); // NULL if none
+// Replaces an existing handler, NULL removes it. 0 on success, 1 if full
+uint8_t protocolRegister(ProtocolTable *t, uint16_t type, PacketHandler handler);
+
+// Allows rate packets per second on average, up to burst at once.
+typedef struct {
+    tick_t last; // Time the last token was added
+    uint8_t tokens;
+    uint8_t burst;
+    uint8_t rate;
+} TokenBucket;
+
+#define TOKEN_BUCKET(rate, burst) { 0, (burst), (burst), (rate) }
+
+// 1 if the packet may be processed, 0 if it should be dropped
+uint8_t tokenBucketTake(TokenBucket *b);
+
 #endif
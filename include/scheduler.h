@@ -28,26 +28,97 @@
  * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 /*
- * A very simple task scheduler. You can register up to 254 tasks.
+ * A very simple task scheduler. You can have up to SCHEDULER_MAX tasks running.
  * Each task can be executed in different frequencies,
- * from 1ms between each execution up to (2^64 - 1)ms
+ * from 1ms between each execution up to (2^31 - 1)ms
  * Add tasks with addTimedTasks(foo, 1000);
  * Then Execute them in the main loop with while(1) { scheduler(); }
+ *
+ * If you need to cancel or restart a timeout, use a Timer instead.
+ * It is owned by the caller (usually a static variable), so arming
+ * it never allocates memory:
+ *     Timer t;
+ *     timerInit(&t, foo);
+ *     timerStart(&t, 2000, 0); // Call foo() once in 2 seconds
+ *     timerCancel(&t);
  */
 #ifndef _scheduler_h
 #define _scheduler_h
 
-#include <time.h> // time_t definition
+#include <time.h> // tick_t definition
 #include <tasks.h> // Task definition
+#include <slab.h>
 
 #define schedulerTimeFunc(x) getSystemTime(x) // has to return system time in milliseconds
+#define SCHEDULER_MAX 16 // Max. number of running timers, 2 bytes each
+
+typedef struct {
+    Task task;
+    tick_t period; // 0 for one-shot timers
+    tick_t deadline; // absolute, in schedulerTimeFunc() time
+    uint8_t index; // Position in the scheduler heap, TIMER_STOPPED if not running
+    uint8_t flags;
+#ifndef DISABLE_TASK_PROFILING
+    TaskStats stats;
+#endif
+} Timer;
+
+#define TIMER_STOPPED 0xFF
+
+void timerInit(Timer *t, Task func);
+// Call func after timeout milliseconds, then every period milliseconds
+// if period != 0. Restarts the timer if it is already running.
+uint8_t timerStart(Timer *t, tick_t timeout, tick_t period); // 0 on success
+void timerCancel(Timer *t); // Does nothing if the timer is not running
+uint8_t timerIsRunning(Timer *t);
+// Milliseconds until the timer fires, 0 if due, SCHEDULER_IDLE if stopped
+tick_t timerRemaining(Timer *t);
 
 // Add a new timed task. Calling scheduler() in your main-loop
 // will cause a call to func() every intervall milliseconds, if repeat != 0.
 // If repeat == 0, func will be called once after intervall milliseconds.
-uint8_t addTimedTask(Task func, time_t intervall, uint8_t repeat); // 0 on success
+// Repeated tasks don't drift. If scheduler() was called too late,
+// the missed executions are caught up in the following calls.
+uint8_t addTimedTask(Task func, tick_t intervall, uint8_t repeat); // 0 on success
 void scheduler(void); // Call this in your main loop!
 
+// Milliseconds until the next timed task is due, 0 if it is already due.
+// SCHEDULER_IDLE if there are no timed tasks.
+tick_t schedulerNextDeadline(void);
+#define SCHEDULER_IDLE 0xFFFFFFFF
+
 uint8_t schedulerRegistered(void);
+extern Slab timerSlab; // Timers of addTimedTask()
+
+// Timers that are known at compile time can be declared in a table
+// in flash. At file scope:
+//     STATIC_TIMERS(myTimers,
+//         TIMER(heartbeat, 500, 500) // First call after 500ms, then every 500ms
+//     );
+// Then call startStaticTimers(myTimers); once. The Timer of the n-th entry
+// is myTimersTimers[n], if you want to cancel or restart it.
+
+typedef struct {
+    Task task;
+    tick_t timeout;
+    tick_t period;
+} TimerDescriptor;
+
+#define TIMER(func, timeout, period) { (func), (timeout), (period) }
+
+#define STATIC_TIMERS(table, ...) \
+    const TimerDescriptor table##Descriptors[] PROGMEM = { __VA_ARGS__ }; \
+    Timer table##Timers[sizeof(table##Descriptors) / sizeof(TimerDescriptor)]
+
+#define startStaticTimers(table) timerStartStatic(table##Descriptors, table##Timers, \
+        sizeof(table##Descriptors) / sizeof(TimerDescriptor))
+
+uint8_t timerStartStatic(const TimerDescriptor *d, Timer *t, uint8_t count); // 0 on success
+
+#ifndef DISABLE_TASK_PROFILING
+// Statistics of the i-th running timer, NULL if there is none.
+// func is set to the task of the timer, if not NULL.
+TaskStats *timerGetStats(uint8_t i, Task *func);
+#endif
 
 #endif
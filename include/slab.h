@@ -0,0 +1,64 @@
+/*
+ * slab.h
+ *
+ * Copyright (c) 2012, Thomas Buck <xythobuz@me.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+/*
+ * Slabs of fixed size objects, for small structures that would
+ * otherwise fragment the heap. Memory is reserved at compile time:
+ *     SLAB(fooSlab, Foo, 8); // At file scope, 8 objects of type Foo
+ *     Foo *f = (Foo *)slabAlloc(&fooSlab);
+ *     slabFree(&fooSlab, f);
+ * Allocation and freeing are O(1).
+ */
+#ifndef _slab_h
+#define _slab_h
+
+#include <stdint.h>
+#include <stdlib.h>
+
+typedef struct {
+    void *free; // Freed objects, linked through their first bytes
+    uint8_t *memory;
+    uint16_t size; // Bytes per object
+    uint8_t count; // Objects in this slab
+    uint8_t fresh; // Objects at the start of memory that were handed out once
+    uint8_t used;
+    uint8_t peak; // Max. used at the same time
+    uint16_t fails; // Allocations while all objects were used
+} Slab;
+
+#define SLABOBJECT(size) (((size) < sizeof(void *)) ? sizeof(void *) : (size))
+
+#define SLAB(name, type, n) \
+    uint8_t name##Memory[(n) * SLABOBJECT(sizeof(type))]; \
+    Slab name = { NULL, name##Memory, SLABOBJECT(sizeof(type)), (n), 0, 0, 0, 0 }
+
+void *slabAlloc(Slab *s); // NULL if all objects are used
+void slabFree(Slab *s, void *p);
+
+#endif
@@ -31,17 +31,86 @@
 #define _std_h
 
 #include <stdlib.h>
+#include <stdint.h>
+#include <net/controller.h> // DISABLE_HEAP may be defined there
 
 // #define DISABLE_HEAP_LOG // Uncomment this line to disable allocation logging...
 
 extern uint8_t __heap_start; // Declared in linker script
 #define HEAPSIZE (SP - (uint16_t)&__heap_start)
 
+#ifndef DISABLE_HEAP
+
+// Allocations are counted per call site, the line and a tag for the
+// module, to find leaks. #define HEAP_TAG HEAP_TAG_xxx before including
+// std.h, so lines in different files can be told apart.
+#define HEAP_TAG_OTHER 0
+#define HEAP_TAG_DRIVER 1
+#define HEAP_TAG_APP 2
+#define HEAPSITES 8 // Call sites that are counted, 7 bytes each
+
+#ifndef HEAP_TAG
+#define HEAP_TAG HEAP_TAG_OTHER
+#endif
+
+#ifndef DISABLE_HEAP_LOG
+
+typedef struct {
+    uint16_t line; // __LINE__, 0 if unused or shared by all sites that didn't fit
+    uint8_t tag;
+    uint16_t count; // Outstanding allocations
+    uint16_t bytes;
+} HeapSite;
+
 extern uint32_t heapBytesAllocated; // Number of bytes allocated
+extern uint32_t heapBytesPeak; // Max. of heapBytesAllocated
+extern uint16_t heapFailures; // Allocations that returned NULL
+extern HeapSite heapSites[HEAPSITES];
+
+#define mmalloc(size) heapAlloc((size), HEAP_TAG, __LINE__) // Use like regular malloc
+#define mrealloc(ptr, newSize, oldSize) heapRealloc((ptr), (newSize), HEAP_TAG, __LINE__) // like realloc
+#define mcalloc(n, s) heapCalloc((n), (s), HEAP_TAG, __LINE__) // Use like regular calloc
+#define mfree(ptr, size) heapFree((ptr), (size)) // Use like free, size is checked
+
+void *heapAlloc(size_t size, uint8_t tag, uint16_t line);
+void *heapRealloc(void *ptr, size_t newSize, uint8_t tag, uint16_t line);
+void *heapCalloc(size_t n, size_t s, uint8_t tag, uint16_t line);
+void heapFree(void *ptr, size_t size);
+
+#else // DISABLE_HEAP_LOG defined
+
+#define mmalloc(size) malloc(size)
+#define mrealloc(ptr, newSize, oldSize) realloc((ptr), (newSize))
+#define mcalloc(n, s) calloc((n), (s))
+#define mfree(ptr, size) free(ptr)
+
+#endif // DISABLE_HEAP_LOG
+
+// Largest block that could be allocated right now.
+// Free list of malloc and space between heap and stack.
+size_t heapLargestFree(void);
+
+#endif // DISABLE_HEAP
+// With DISABLE_HEAP, mmalloc() & Co. don't exist, so nothing can
+// use the heap by accident and malloc is not linked.
+
+// The free RAM between heap and stack is painted with STACK_CANARY
+// before main() runs. Everything the stack has touched since then is
+// no longer painted, so the remaining bytes show how close the stack
+// came to the heap (or .bss with DISABLE_HEAP).
+// stackCheck() runs every STACK_CHECK_INTERVAL from its own Timer,
+// started by networkInit() or stackSetAlarm().
+#define STACK_CANARY 0xC5
+#define STACK_ALARM 64 // Default alarm limit in bytes
+#define STACK_CHECK_INTERVAL 1000 // ms
+
+typedef void (*StackAlarm)(uint16_t); // Gets current headroom
+
+extern uint16_t stackMinFree; // Lowest headroom stackCheck() has seen
 
-void *mmalloc(size_t size); // Use like regular malloc
-void *mrealloc(void *ptr, size_t newSize, size_t oldSize); // like realloc, but needs oldsize
-void *mcalloc(size_t n, size_t s); // Use like regular calloc
-void mfree(void *ptr, size_t size); // Use like free, but give it the size too
+uint16_t stackUnusedBytes(void); // Painted bytes above the heap, right now
+void stackCheck(void); // Updates stackMinFree, calls alarm below limit
+void stackSetAlarm(uint16_t limit, StackAlarm handler); // NULL to disable
+void stackCheckStart(void); // Start the Timer, if it is not yet running
 
 #endif
@@ -30,15 +30,96 @@
 #ifndef _tasks_h
 #define _tasks_h
 
+#include <avr/pgmspace.h>
+#include <slab.h>
+
 typedef void (*Task)(void);
 typedef uint8_t (*TestFunc)(void);
 
+// Count calls and execution time of every task and timer.
+// Costs 12 bytes of RAM per task and timer.
+// #define DISABLE_TASK_PROFILING
+
+#ifndef DISABLE_TASK_PROFILING
+typedef struct {
+    uint32_t calls;
+    uint32_t time; // us, all calls
+    uint16_t max; // us, longest call
+    uint16_t late; // ms, timers only: longest delay after the deadline
+} TaskStats;
+
+void taskStatsUpdate(TaskStats *s, uint32_t start); // start from getSystemTimeUs()
+// Statistics of the i-th task, NULL if there is none. name may be NULL.
+TaskStats *taskGetStats(uint8_t i, char **name);
+#endif
+
+// Tasks with a lower number are executed first
+#define TASK_PRIORITY_HIGH 0 // Network driver
+#define TASK_PRIORITY_NORMAL 128 // Default for addTask()
+#define TASK_PRIORITY_LOW 255
+
+#define TASK_EVENTS_MAX 16 // Max. number of event tasks
+#define TASK_NO_EVENT 0xFF
+
 // Adds another task that will cause func() to be called
 // when testFunc() returns a value other than zero or always,
 // if testFunc == NULL
 uint8_t addTask(Task func, TestFunc testFunc, char *name); // 0 on success
-void tasks(void); // Call in your main loop!
+uint8_t addTaskPriority(Task func, TestFunc testFunc, char *name, uint8_t priority);
+
+// Adds a task that is only called after its event was posted with
+// taskPost(). Returns the event id or TASK_NO_EVENT on error.
+uint8_t addEventTask(Task func, char *name, uint8_t priority);
+void taskPost(uint8_t event); // Can also be called from an ISR
+uint8_t tasksPending(void); // Events posted but not yet handled?
+
+// Call in your main loop! Returns number of tasks executed.
+// If a task posts an event for a task with higher priority,
+// that one runs before the remaining tasks.
+uint8_t tasks(void);
 
 uint8_t tasksRegistered(void);
+extern Slab taskSlab; // Tasks added at runtime
+
+// Tasks that are known at compile time can be declared in a table,
+// that is stored in flash. Only a small state per task is kept in RAM
+// and nothing is allocated. At file scope:
+//     STATIC_TASKS(myTasks,
+//         TASK(serialHandler, serialHasChar, "Serial", TASK_PRIORITY_NORMAL),
+//         EVENT_TASK(sendQueue, "Send", TASK_PRIORITY_HIGH, &sendEvent)
+//     );
+// Then call registerStaticTasks(myTasks); once.
+
+typedef struct {
+    Task task;
+    TestFunc test; // NULL for event tasks or tasks that always run
+    char *name;
+    uint8_t priority;
+    uint8_t *event; // Event tasks: receives the event id, else NULL
+} TaskDescriptor;
+
+// RAM state of a task. Only public for STATIC_TASKS.
+typedef struct TaskElement TaskElement;
+struct TaskElement {
+    const TaskDescriptor *desc;
+    TaskElement *next;
+    uint16_t event; // Event bit, 0 for polled tasks
+    uint8_t flags;
+#ifndef DISABLE_TASK_PROFILING
+    TaskStats stats;
+#endif
+};
+
+#define TASK(func, test, name, priority) { (func), (test), (name), (priority), NULL }
+#define EVENT_TASK(func, name, priority, event) { (func), NULL, (name), (priority), (event) }
+
+#define STATIC_TASKS(table, ...) \
+    const TaskDescriptor table##Descriptors[] PROGMEM = { __VA_ARGS__ }; \
+    TaskElement table##Elements[sizeof(table##Descriptors) / sizeof(TaskDescriptor)]
+
+#define registerStaticTasks(table) addStaticTasks(table##Descriptors, table##Elements, \
+        sizeof(table##Descriptors) / sizeof(TaskDescriptor))
+
+uint8_t addStaticTasks(const TaskDescriptor *d, TaskElement *e, uint8_t count); // 0 on success
 
 #endif
@@ -32,21 +32,48 @@
 
 #define TIMEZONE 1 // If you're eg. GMT-5, enter -5 or -4 on DST
 
-typedef uint64_t time_t; // For milliseconds since system start or UNIX timestamp
+// #define TIMER_TICKLESS // Stretch timer periods while sleeping, see timerSleep()
+
+typedef uint64_t time_t; // For UNIX timestamps and long uptimes
+typedef uint32_t tick_t; // Milliseconds since system start, wraps after 49 days
 
 void initSystemTimer(void);
 
-time_t getSystemTime(void); // System uptime in ms
+// Monotonic time. Counts up steadily, never affected by setTimestamp().
+// Use this for timeouts and intervals.
+tick_t getSystemTime(void); // System uptime in ms
+uint32_t getSystemTimeUs(void); // System uptime in us, wraps after 71 minutes
+time_t getUptime(void); // System uptime in ms, does not wrap
 time_t getSystemTimeSeconds(void); // System uptime in seconds
 
-time_t diffTime(time_t a, time_t b);
+// Distance between two getSystemTime() values, handles wrap around.
+tick_t diffTime(tick_t a, tick_t b);
 
 uint8_t daysInMonth(uint8_t month, uint16_t year);
 uint8_t isLeapYear(uint16_t year);
 
+// Real time. Kept as an offset to the monotonic time,
+// so setting it does not disturb running timeouts.
+time_t getUnixTime(void); // UNIX timestamp in seconds, 0 if not yet set
+uint8_t unixTimeIsSet(void); // 1 if setTimestamp() was called
+time_t getUnixTimeMs(void); // UNIX time in ms, counts from 0 if not yet set
 void setTimestamp(time_t unix);
+void setTimestampMs(time_t unixMs);
 void setNtpTimestamp(time_t ntp);
 
+// Clock discipline. Both corrections change the tick rate, so the
+// monotonic time stays monotonic and the wall clock never jumps.
+void timeSetFrequency(int32_t ppb); // Positive if our crystal is too slow
+int32_t timeGetFrequency(void);
+void timeAdjust(int32_t ms); // Slew offset of ms into the clock, with 500ppm
+int32_t timeAdjustRemaining(void); // Part of the offset not yet slewed
+
+#ifdef TIMER_TICKLESS
+// Puts the MCU to sleep until an interrupt occurs, but not longer
+// than ms milliseconds. Call it again to sleep longer.
+void timerSleep(tick_t ms);
+#endif
+
 // Fills y, m, d, h, min & sec with stamps values
 void convertTimestamp(time_t stamp, uint16_t *y, uint8_t *m, uint8_t *d,
                         uint8_t *h, uint8_t *min, uint8_t *sec);
@@ -0,0 +1,132 @@
+/*
+ * coroutine.c
+ *
+ * Copyright (c) 2012, Thomas Buck <xythobuz@me.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+/*
+ * Runs all started coroutines from a single event task.
+ */
+#include <stdlib.h>
+#include <stdint.h>
+
+#include <tasks.h>
+#include <scheduler.h>
+#include <coroutine.h>
+
+Coroutine *crList = NULL;
+uint8_t crEvent = TASK_NO_EVENT;
+Timer crTimer; // Fires at the earliest CR_WAIT_TIMEOUT deadline
+
+// ----------------------
+// |      Internal      |
+// ----------------------
+
+void crRemove(Coroutine *c) {
+    Coroutine **l = &crList;
+    while (*l != NULL) {
+        if (*l == c) {
+            *l = c->next;
+            break;
+        }
+        l = &((*l)->next);
+    }
+    c->flags &= ~CR_FLAG_RUNNING;
+}
+
+void crRun(void) {
+    Coroutine *c = crList, *next;
+    tick_t left, min = SCHEDULER_IDLE;
+    while (c != NULL) {
+        next = c->next; // c may be removed
+        c->flags &= ~CR_FLAG_YIELD;
+        if (c->func(c) == CR_DONE) {
+            crRemove(c);
+        }
+        c = next;
+    }
+
+    // Sleep until the next deadline or crWake()
+    for (c = crList; c != NULL; c = c->next) {
+        if (c->flags & CR_FLAG_YIELD) {
+            min = 0;
+        } else if (c->flags & CR_FLAG_DEADLINE) {
+            left = c->deadline - getSystemTime();
+            if ((int32_t)left < 0) {
+                left = 0;
+            }
+            if (left < min) {
+                min = left;
+            }
+        }
+    }
+    if (min == 0) {
+        timerCancel(&crTimer);
+        taskPost(crEvent);
+    } else if (min == SCHEDULER_IDLE) {
+        timerCancel(&crTimer);
+    } else {
+        timerStart(&crTimer, min, 0);
+    }
+}
+
+// ----------------------
+// |    External API    |
+// ----------------------
+
+uint8_t crStart(Coroutine *c, CoroutineFunc func) {
+    if (crEvent == TASK_NO_EVENT) {
+        crEvent = addEventTask(crRun, "Coroutines", TASK_PRIORITY_NORMAL);
+        if (crEvent == TASK_NO_EVENT) {
+            return 1;
+        }
+        timerInit(&crTimer, crWake);
+    }
+    if (crIsRunning(c)) {
+        return 1;
+    }
+    c->func = func;
+    c->line = 0;
+    c->flags = CR_FLAG_RUNNING;
+    c->next = crList;
+    crList = c;
+    taskPost(crEvent); // Run it up to the first wait
+    return 0;
+}
+
+void crStop(Coroutine *c) {
+    if (crIsRunning(c)) {
+        crRemove(c);
+    }
+}
+
+uint8_t crIsRunning(Coroutine *c) {
+    return (c->flags & CR_FLAG_RUNNING);
+}
+
+void crWake(void) {
+    taskPost(crEvent);
+}
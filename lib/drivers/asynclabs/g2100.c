@@ -41,6 +41,7 @@
 #include <string.h>
 
 #include <net/controller.h>
+#define HEAP_TAG HEAP_TAG_DRIVER
 #include <std.h>
 #include <spi.h>
 
@@ -58,6 +59,9 @@ unsigned char  tx_ready;
 unsigned char  rx_ready;
 unsigned char  cnf_pending;
 unsigned char* zg_buf;
+#ifdef DISABLE_HEAP
+unsigned char zgStaticBuffer[150];
+#endif
 unsigned int   zg_buf_len;
 
 unsigned char  wpa_psk_key[32];
@@ -80,7 +84,11 @@ void zg_init()
     // zg_buf = MyNetworkBuffer;
     // zg_buf_len = NETWORK_BUFSIZE;
 
+#ifdef DISABLE_HEAP
+    zg_buf = zgStaticBuffer;
+#else
     zg_buf = mmalloc(150);
+#endif
     zg_buf_len = 150;
 
     zg_chip_reset();
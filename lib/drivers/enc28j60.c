@@ -87,13 +87,12 @@ uint8_t currentBank = 0;
 uint16_t nextPacketPointer;
 uint8_t statusVector[7];
 
-uint8_t ownMacAddress[6] = {0x00, 0x04, 0xA3, 0x00, 0x00, 0x00}; // Sane default
-
 // ENC28J60 ISP Command Set, implemented at end of file
 uint8_t readControlRegister(uint8_t a);
-uint8_t *readBufferMemory(uint8_t *d, uint8_t length);
+uint8_t *readBufferMemory(uint8_t *d, uint16_t length);
 void writeControlRegister(uint8_t a, uint8_t d);
-void writeBufferMemory(uint8_t *d, uint8_t length);
+void writeBufferMemory(uint8_t *d, uint16_t length);
+void writeBufferSegment(PacketSegment *s);
 void bitFieldSet(uint8_t a, uint8_t d);
 void bitFieldClear(uint8_t a, uint8_t d);
 void systemResetCommand(void);
@@ -143,13 +142,15 @@ void writePhyRegister(uint8_t a, uint16_t d) {
 
 void discardPacket(void) {
     // Silicon Errata Issue 14: Only odd values into ERXRDPT, nextPacketPointer always even...
-    if (nextPacketPointer == RXSTART) {
-        nextPacketPointer = RXEND;
+    // nextPacketPointer itself has to stay where the next packet starts.
+    uint16_t a = nextPacketPointer;
+    if (a == RXSTART) {
+        a = RXEND;
     } else {
-        nextPacketPointer--;
+        a--;
     }
-    writeControlRegister(0x08, (nextPacketPointer & 0xFF)); // set ERXRDPTL
-    writeControlRegister(0x09, (nextPacketPointer & 0xFF00) >> 8); // set ERXRDPTH
+    writeControlRegister(0x08, (a & 0xFF)); // set ERXRDPTL
+    writeControlRegister(0x09, (a & 0xFF00) >> 8); // set ERXRDPTH
     bitFieldSet(0x1E, (1 << 6)); // Set ECON2.PKTDEC
 }
 
@@ -157,11 +158,11 @@ void discardPacket(void) {
 // |            MAC API             |
 // ----------------------------------
 
-void macReset(void) {
+void enc28j60Reset(void) {
     systemResetCommand();
 }
 
-uint8_t macHasInterrupt(void) {
+uint8_t enc28j60HasInterrupt(void) {
     if (INTPORTPIN & (1 << INTPIN)) {
         return 0;
     } else {
@@ -169,7 +170,12 @@ uint8_t macHasInterrupt(void) {
     }
 }
 
-uint8_t macInitialize(uint8_t *address) { // 0 if success, 1 on error
+uint8_t enc28j60EnableWakeup(void) {
+    // INT is connected to PC3, which can't trigger an interrupt
+    return 0;
+}
+
+uint8_t enc28j60Initialize(uint8_t *address) { // 0 if success, 1 on error
     uint16_t phy = 0;
     uint8_t i;
 
@@ -185,12 +191,6 @@ uint8_t macInitialize(uint8_t *address) { // 0 if success, 1 on error
 
     _delay_ms(1); // See Silicon Errata Issue 2
 
-    if ((address != NULL) && (address != ownMacAddress)) {
-        for (i = 0; i < 6; i++) {
-            ownMacAddress[i] = address[i];
-        }
-    }
-
     selectBank(0);
 
     // Initialization as described in the datasheet, p. 35ff
@@ -238,12 +238,12 @@ uint8_t macInitialize(uint8_t *address) { // 0 if success, 1 on error
     // 8) For half duplex, set MACLCON1 & 2 to their default values
     // 9) Write local MAC Address into MAADR1:MAADR6
     selectBank(3);
-    writeControlRegister(0x04, ownMacAddress[0]);
-    writeControlRegister(0x05, ownMacAddress[1]);
-    writeControlRegister(0x02, ownMacAddress[2]);
-    writeControlRegister(0x03, ownMacAddress[3]);
-    writeControlRegister(0x00, ownMacAddress[4]);
-    writeControlRegister(0x01, ownMacAddress[5]);
+    writeControlRegister(0x04, address[0]);
+    writeControlRegister(0x05, address[1]);
+    writeControlRegister(0x02, address[2]);
+    writeControlRegister(0x03, address[3]);
+    writeControlRegister(0x00, address[4]);
+    writeControlRegister(0x01, address[5]);
     // Always reset bank selection to zero!!
     selectBank(0);
 
@@ -299,7 +299,7 @@ uint8_t macInitialize(uint8_t *address) { // 0 if success, 1 on error
     return 0;
 }
 
-uint8_t macLinkIsUp(void) { // 0 if down, 1 if up
+uint8_t enc28j60LinkIsUp(void) { // 0 if down, 1 if up
     uint16_t p = readPhyRegister(0x11); // Read PHSTAT2
 
 #if DEBUG >= 5
@@ -317,31 +317,36 @@ uint8_t macLinkIsUp(void) { // 0 if down, 1 if up
     }
 }
 
-uint8_t macSendPacket(Packet *p) { // 0 on success, 1 on error
+uint8_t enc28j60SendPacket(Packet *p) { // 0 on success, 1 on error
     // Place Frame data in buffer, with a preceding control byte
     // This control byte can be 0x00, as we set everything needed in MACON3
     uint8_t i = 0x00;
-    uint16_t a;
+    uint16_t a, length = packetLength(p);
+    PacketSegment *s;
 
-    assert(p->dLength > 0);
-    assert(p->dLength <= MaxPacketSize);
+    assert(length > 0);
+    assert(length <= MaxPacketSize);
 
     selectBank(0);
     writeControlRegister(0x04, (TXSTART & 0xFF)); // set ETXSTL
     writeControlRegister(0x05, (TXSTART & 0xFF00) >> 8); // set ETXSTH --> TXSTART
 
-    if ((TXSTART + p->dLength) >= TXEND) {
+    if ((TXSTART + length) >= TXEND) {
         return 1;
     }
 
-    // Write packet data into buffer
+    // Write packet data into buffer. The write pointer auto-increments,
+    // so the segments of the chain just follow the data.
     writeControlRegister(0x02, (TXSTART & 0xFF)); // EWRPTL
     writeControlRegister(0x03, (TXSTART & 0xFF00) >> 8); // EWRPTH --> TXSTART
     writeBufferMemory(&i, 1); // Write 0x00 as control byte
     writeBufferMemory(p->d, p->dLength); // Write data payload
+    for (s = p->chain; s != NULL; s = s->next) {
+        writeBufferSegment(s);
+    }
 
-    writeControlRegister(0x06, (uint8_t)((TXSTART + p->dLength) & 0x00FF)); // ETXNDL
-    writeControlRegister(0x07, (uint8_t)(((TXSTART + p->dLength) & 0xFF00) >> 8)); // ETXNDH --> dLength + TXSTART
+    writeControlRegister(0x06, (uint8_t)((TXSTART + length) & 0x00FF)); // ETXNDL
+    writeControlRegister(0x07, (uint8_t)(((TXSTART + length) & 0xFF00) >> 8)); // ETXNDH --> length + TXSTART
 
     // Silicon Errata Issue 12: Reset Transmit Logic before starting transmission
     bitFieldSet(0x1F, 0x80); // Set ECON1.TXRST
@@ -362,12 +367,12 @@ uint8_t macSendPacket(Packet *p) { // 0 on success, 1 on error
 
 #if DEBUG >= 2
     debugPrint("Sending Packet with ");
-    debugPrint(timeToString(p->dLength));
+    debugPrint(timeToString(length));
     debugPrint(" bytes...\n");
 #endif
 
     // Get status vector
-    a = TXSTART + 1 + p->dLength; // 1 Control byte in front
+    a = TXSTART + 1 + length; // 1 Control byte in front
     writeControlRegister(0x00, (uint8_t)(a & 0xFF)); // Set ERDPTL
     writeControlRegister(0x01, (uint8_t)((a & 0xFF00) >> 8)); // Set ERDPTH
     readBufferMemory(statusVector, 7); // Read status vector
@@ -414,7 +419,7 @@ uint8_t macSendPacket(Packet *p) { // 0 on success, 1 on error
     }
 }
 
-uint8_t macPacketsReceived(void) { // Returns number of packets ready
+uint8_t enc28j60PacketsReceived(void) { // Returns number of packets ready
     uint8_t r;
     selectBank(1);
     r = readControlRegister(0x19); // EPKTCNT
@@ -422,16 +427,17 @@ uint8_t macPacketsReceived(void) { // Returns number of packets ready
     return r;
 }
 
-Packet *macGetPacket(void) { // Returns NULL or Packet with d == NULL on error
+Packet *enc28j60GetPacket(void) { // Returns NULL on error
     // Read and store next packet pointer,
     // check receive status vector for errors, if they exist, throw packet away
     // else read packet, return it
     uint8_t d;
     uint8_t header[4];
     uint16_t fullLength;
+    uint16_t thisPacketPointer = nextPacketPointer;
     Packet *p;
 
-    if (macPacketsReceived() < 1) {
+    if (enc28j60PacketsReceived() < 1) {
         return NULL;
     }
 
@@ -470,15 +476,14 @@ Packet *macGetPacket(void) { // Returns NULL or Packet with d == NULL on error
         assert(fullLength > 0);
         assert(fullLength <= MaxPacketSize);
 
-        p = (Packet *)mmalloc(sizeof(Packet));
+        p = packetAlloc(fullLength);
         if (p == NULL) {
-            return NULL;
-        }
-        p->dLength = fullLength;
-        p->d = (uint8_t *)mmalloc(p->dLength * sizeof(uint8_t));
-        if (p->d == NULL) {
-            // discardPacket(); // Try again later
-            mfree(p, sizeof(Packet));
+            if (fullLength > PacketMaxLength) {
+                discardPacket(); // We could never handle it
+            } else {
+                // Leave it in the FIFO and try again when a buffer is free
+                nextPacketPointer = thisPacketPointer;
+            }
             return NULL;
         }
         readBufferMemory(p->d, p->dLength); // Read payload
@@ -490,6 +495,18 @@ Packet *macGetPacket(void) { // Returns NULL or Packet with d == NULL on error
     }
 }
 
+const MacDriver enc28j60Driver = {
+    enc28j60Initialize,
+    enc28j60Reset,
+    enc28j60LinkIsUp,
+    enc28j60SendPacket,
+    enc28j60PacketsReceived,
+    enc28j60GetPacket,
+    enc28j60HasInterrupt,
+    enc28j60EnableWakeup,
+    1 // Writes segments into its TX memory
+};
+
 // ----------------------------------
 // |      ENC28J60 Command Set      |
 // ----------------------------------
@@ -510,8 +527,8 @@ uint8_t readControlRegister(uint8_t a) {
     return r;
 }
 
-uint8_t *readBufferMemory(uint8_t *d, uint8_t length) {
-    uint8_t i;
+uint8_t *readBufferMemory(uint8_t *d, uint16_t length) {
+    uint16_t i;
     ACTIVATE();
     spiSendByte(0x3A);
     for (i = 0; i < length; i++) {
@@ -531,8 +548,8 @@ void writeControlRegister(uint8_t a, uint8_t d) {
     DEACTIVATE();
 }
 
-void writeBufferMemory(uint8_t *d, uint8_t length) {
-    uint8_t i;
+void writeBufferMemory(uint8_t *d, uint16_t length) {
+    uint16_t i;
     // Opcode: 011
     // Argument: 11010
     // Following: dddddddd
@@ -544,6 +561,17 @@ void writeBufferMemory(uint8_t *d, uint8_t length) {
     DEACTIVATE();
 }
 
+// Like writeBufferMemory, but data can also come from Flash or EEPROM
+void writeBufferSegment(PacketSegment *s) {
+    uint16_t i;
+    ACTIVATE();
+    spiSendByte(0x7A);
+    for (i = 0; i < s->length; i++) {
+        spiSendByte(segmentByte(s, i));
+    }
+    DEACTIVATE();
+}
+
 void bitFieldSet(uint8_t a, uint8_t d) {
     // Opcode: 100
     // Argument: aaaaa
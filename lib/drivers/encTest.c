@@ -8,51 +8,43 @@
 
 #include <util/delay.h>
 
-#define MAXRECVLEN 400
+#define MAXRECVLEN PacketMaxLength
 
-uint8_t ownMacAddress[6];
-
-uint8_t macInitialize(uint8_t *address) {
+uint8_t encTestInitialize(uint8_t *address) {
     debugPrint("Init ENC...");
     enc28j60Init(address);
     debugPrint(" Done!\n");
     return 0;
 }
 
-void macReset(void) {
+void encTestReset(void) {
     // perform system reset
     enc28j60WriteOp(ENC28J60_SOFT_RESET, 0, ENC28J60_SOFT_RESET);
     _delay_ms(20);
 }
 
-uint8_t macLinkIsUp(void) {
+uint8_t encTestLinkIsUp(void) {
     return enc28j60linkup();
 }
 
-uint8_t macSendPacket(Packet *p) {
+uint8_t encTestSendPacket(Packet *p) {
     enc28j60PacketSend(p->dLength, p->d);
     return 0;
 }
 
-uint8_t macPacketsReceived(void) {
+uint8_t encTestPacketsReceived(void) {
     return enc28j60hasRxPkt();
 }
 
-Packet *macGetPacket(void) {
-    if (macPacketsReceived()) {
-        Packet *p = (Packet *)mmalloc(sizeof(Packet));
+Packet *encTestGetPacket(void) {
+    if (encTestPacketsReceived()) {
+        Packet *p = packetAlloc(MAXRECVLEN);
         if (p == NULL) {
             return NULL;
         }
-        p->d = (uint8_t *)mmalloc(MAXRECVLEN);
-        if (p->d == NULL) {
-            mfree(p, sizeof(Packet));
-            return NULL;
-        }
         p->dLength = enc28j60PacketReceive(MAXRECVLEN, p->d);
         if (p->dLength == 0) {
-            mfree(p->d, MAXRECVLEN);
-            mfree(p, sizeof(Packet));
+            packetRelease(p);
             return NULL;
         }
         return p;
@@ -61,6 +53,22 @@ Packet *macGetPacket(void) {
     }
 }
 
-uint8_t macHasInterrupt(void) {
-    return macPacketsReceived();
+uint8_t encTestHasInterrupt(void) {
+    return encTestPacketsReceived();
 }
+
+uint8_t encTestEnableWakeup(void) {
+    return 0;
+}
+
+const MacDriver encTestDriver = {
+    encTestInitialize,
+    encTestReset,
+    encTestLinkIsUp,
+    encTestSendPacket,
+    encTestPacketsReceived,
+    encTestGetPacket,
+    encTestHasInterrupt,
+    encTestEnableWakeup,
+    0 // Only sends p->d
+};
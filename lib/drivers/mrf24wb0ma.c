@@ -30,12 +30,14 @@
 #include <avr/io.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <avr/interrupt.h>
 
 #define DEBUG 2
 // 1 --> Debug Output
 // 2 --> Interactive Passphrase Prompt
 
 #include <std.h>
+#include <time.h>
 #include <tasks.h>
 #include <net/mac.h>
 #include <net/controller.h>
@@ -48,7 +50,8 @@
 #define INTPIN PD2
 #define INTDDR DDRD
 
-uint8_t ownMacAddress[6];
+#define CONNECT_TIMEOUT 1000 // ms, below the watchdog timeout
+
 uint8_t shouldGetPacket = 0;
 
 extern uint8_t *zg_buf;
@@ -68,6 +71,8 @@ unsigned char wep_keys[52] PROGMEM = { // WEP 128-bit keys
 };
 uint8_t zg2100IsrEnabled; // In asynclabs spi.h
 
+uint8_t mrf24wb0maLinkIsUp(void);
+
 uint8_t zgInterruptOccured(void) {
     if (zg2100IsrEnabled) {
         if (INTPORTPIN & (1 << INTPIN)) {
@@ -77,9 +82,10 @@ uint8_t zgInterruptOccured(void) {
     return 0;
 }
 
-uint8_t macInitialize(uint8_t *address) { // 0 if success, 1 on error
+uint8_t mrf24wb0maInitialize(uint8_t *address) { // 0 if success, 1 on error
     uint8_t i;
     uint8_t *p;
+    tick_t start;
 
     INTDDR &= ~(1 << INTPIN); // Interrupt PIN
 
@@ -89,27 +95,34 @@ uint8_t macInitialize(uint8_t *address) { // 0 if success, 1 on error
 
     debugPrint(" Done!\nConnecting...");
 
-    addConditionalTask(zg_isr, zgInterruptOccured); // Emulate INT0
+    if (addTaskPriority(zg_isr, zgInterruptOccured, "WiFi", TASK_PRIORITY_HIGH)) { // Emulate INT0
+        debugPrint(" No task!\n");
+        return 1;
+    }
+    start = getSystemTime();
     do {
         zg_drv_process();
-    } while (!macLinkIsUp());
+        if (diffTime(getSystemTime(), start) > CONNECT_TIMEOUT) {
+            debugPrint(" Timeout!\n");
+            return 1;
+        }
+    } while (!mrf24wb0maLinkIsUp());
 
     debugPrint(" Done!\n");
 
     p = zg_get_mac(); // Global Var. in g2100.c
     for (i = 0; i < 6; i++) {
-        ownMacAddress[i] = p[i];
-        address[i] = ownMacAddress[i];
+        address[i] = p[i];
     }
 
     return 0;
 }
 
-void macReset(void) {
+void mrf24wb0maReset(void) {
     zg_chip_reset();
 }
 
-uint8_t macLinkIsUp(void) { // 0 if down, 1 if up
+uint8_t mrf24wb0maLinkIsUp(void) { // 0 if down, 1 if up
     if (zg_get_conn_state()) {
         return 1;
     } else {
@@ -117,11 +130,11 @@ uint8_t macLinkIsUp(void) { // 0 if down, 1 if up
     }
 }
 
-uint8_t macSendPacket(Packet *p) { // 0 on success, 1 on error
-    return 0; // no way to know this?
+uint8_t mrf24wb0maSendPacket(Packet *p) { // 0 on success, 1 on error
+    return 1; // Sending is not yet ported from the g2100 driver
 }
 
-uint8_t macPacketsReceived(void) { // 0 if no packet, 1 if packet ready
+uint8_t mrf24wb0maPacketsReceived(void) { // 0 if no packet, 1 if packet ready
     if (rx_ready) {
         return 1;
     } else {
@@ -134,27 +147,55 @@ uint8_t macPacketsReceived(void) { // 0 if no packet, 1 if packet ready
     }
 }
 
-Packet *macGetPacket(void) { // Returns NULL on error
+Packet *mrf24wb0maGetPacket(void) { // Returns NULL on error
     uint16_t l = zg_get_rx_status();
-    Packet *p = (Packet *)mmalloc(sizeof(Packet));
-    if (p == NULL) {
+    Packet *p;
+    if (l == 0) {
         return NULL;
     }
 
-    p->dLength = l;
-    if (l > 0) {
-        p->d = (uint8_t *)mmalloc(l * sizeof(uint8_t));
-        if (p->d != NULL) {
-            for (uint16_t i = 0; i < l; i++) {
-                p->d[i] = zg_buf[i];
-            }
-        }
-    } else {
-        p->d = NULL;
+    p = packetAlloc(l); // Frame is lost if there's no buffer
+    if (p == NULL) {
+        return NULL;
+    }
+    for (uint16_t i = 0; i < l; i++) {
+        p->d[i] = zg_buf[i];
     }
     return p;
 }
 
-uint8_t macHasInterrupt(void) {
-    return macPacketsReceived();
+uint8_t mrf24wb0maHasInterrupt(void) {
+    return mrf24wb0maPacketsReceived();
 }
+
+uint8_t mrf24wb0maEnableWakeup(void) {
+    // INT is connected to INT0. The interrupt only ends the sleep,
+    // zg_isr() is still called by its task.
+#if defined(__AVR_ATmega32__)
+    MCUCR |= (1 << ISC00); // Any logical change
+    GICR |= (1 << INT0);
+    return 1;
+#elif defined(__AVR_ATmega168__)
+    EICRA |= (1 << ISC00); // Any logical change
+    EIMSK |= (1 << INT0);
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+const MacDriver mrf24wb0maDriver = {
+    mrf24wb0maInitialize,
+    mrf24wb0maReset,
+    mrf24wb0maLinkIsUp,
+    mrf24wb0maSendPacket,
+    mrf24wb0maPacketsReceived,
+    mrf24wb0maGetPacket,
+    mrf24wb0maHasInterrupt,
+    mrf24wb0maEnableWakeup,
+    0 // Only sends p->d
+};
+
+#if defined(__AVR_ATmega32__) || defined(__AVR_ATmega168__)
+EMPTY_INTERRUPT(INT0_vect);
+#endif
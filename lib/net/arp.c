@@ -36,25 +36,47 @@
 // 2 to also get a message for every received ARP Request.
 
 #include <std.h>
+#include <slab.h>
+#include <scheduler.h>
+#include <tasks.h>
 #include <net/mac.h>
 #include <net/ipv4.h>
 #include <net/arp.h>
 #include <net/utils.h>
+#include <net/stats.h>
 #include <serial.h>
 #include <net/controller.h>
 
 ARPTableEntry *arpTable = NULL;
+SLAB(arpSlab, ARPTableEntry, ARPMaxTableSize);
+Timer arpTimer; // Fires when the next entry expires
 
 #define HEADERLEN 6
 const uint8_t ArpPacketHeader[HEADERLEN] PROGMEM = {0x00, 0x01, 0x08, 0x00, 0x06, 0x04};
 
 uint8_t macReturnBuffer[6];
 
+#ifndef DISABLE_RATE_LIMIT
+TokenBucket arpBucket = TOKEN_BUCKET(ARPRateLimit, ARPBurst);
+#endif
+
 // ------------------------
 // |     Internal API     |
 // ------------------------
 
-uint8_t sendArpRequest(IPv4Address ip) {
+// Prepends a broadcast MAC header in front of the ARP packet
+void arpMacHeader(Packet *p) {
+    uint8_t i;
+    packetPush(p, MACPreambleSize);
+    for (i = 0; i < 6; i++) {
+        p->d[MACDestinationOffset + i] = 0xFF;
+        p->d[MACSourceOffset + i] = netInterfaces[p->iface].mac[i];
+    }
+    p->d[MACTypeOffset] = (ARP & 0xFF00) >> 8;
+    p->d[MACTypeOffset + 1] = (ARP & 0x00FF); // ARP Packet
+}
+
+uint8_t sendArpRequest(NetInterface *n, IPv4Address ip) {
     uint8_t i;
     Packet *p;
 #if DEBUG >= 1
@@ -67,49 +89,42 @@ uint8_t sendArpRequest(IPv4Address ip) {
     }
     debugPrint("...");
 #endif
-    p = (Packet *)mmalloc(sizeof(Packet));
+    p = packetAllocHeadroom(MACPreambleSize, HEADERLEN + ARPPacketSize);
     if (p == NULL) {
-        debugPrint("Not enough memory for Packet struct!\n");
-        return 0;
-    }
-    p->dLength = MACPreambleSize + HEADERLEN + ARPPacketSize;
-    p->d = (uint8_t *)mmalloc(p->dLength);
-    if (p->d == NULL) {
-        mfree(p, sizeof(Packet));
+        debugPrint("No buffer for Packet!\n");
+        netCount(arp.noMemory);
         return 0;
     }
+    p->iface = n - netInterfaces;
     for (i = 0; i < 6; i++) {
-        p->d[i] = 0xFF; // Target MAC
-        p->d[6 + i] = ownMacAddress[i];
-        p->d[MACPreambleSize + i] = pgm_read_byte(&(ArpPacketHeader[i])); // ARP Header
-        p->d[MACPreambleSize + HEADERLEN + 2 + i] = ownMacAddress[i];
-        p->d[MACPreambleSize + HEADERLEN + 12 + i] = 0xFF;
+        p->d[i] = pgm_read_byte(&(ArpPacketHeader[i])); // ARP Header
+        p->d[HEADERLEN + 2 + i] = n->mac[i];
+        p->d[HEADERLEN + 12 + i] = 0xFF;
         if (i < 4) {
-            p->d[MACPreambleSize + HEADERLEN + 8 + i] = ownIpAddress[i];
-            p->d[MACPreambleSize + HEADERLEN + 18 + i] = ip[i]; // Target IP
+            p->d[HEADERLEN + 8 + i] = n->ip[i];
+            p->d[HEADERLEN + 18 + i] = ip[i]; // Target IP
         }
     }
-    p->d[12] = (ARP & 0xFF00) >> 8;
-    p->d[13] = (ARP & 0x00FF); // ARP Packet
-    p->d[MACPreambleSize + HEADERLEN] = 0;
-    p->d[MACPreambleSize + HEADERLEN + 1] = 1; // Request
+    p->d[HEADERLEN] = 0;
+    p->d[HEADERLEN + 1] = 1; // Request
+    arpMacHeader(p);
     i = macSendPacket(p);
-    mfree(p->d, p->dLength);
-    mfree(p, sizeof(Packet));
+    packetRelease(p);
     if (i) {
         debugPrint(" Error!\n");
         return 0;
     } else {
         debugPrint(" Done!\n");
+        netCount(arp.tx);
         return 1;
     }
 }
 
-uint8_t isIpInThisNetwork(uint8_t *d) {
+uint8_t isIpInThisNetwork(NetInterface *n, uint8_t *d) {
     uint8_t i;
     for (i = 0; i < 4; i++) {
-        if (subnetmask[i] == 255) {
-            if (d[i] != defaultGateway[i]) {
+        if (n->subnet[i] == 255) {
+            if (d[i] != n->gateway[i]) {
                 return 0;
             }
         }
@@ -117,10 +132,16 @@ uint8_t isIpInThisNetwork(uint8_t *d) {
     return 1;
 }
 
-ARPTableEntry *findIpFromMac(uint8_t *mac) {
+// Entries are only valid on the interface they were learned on,
+// the same IP can belong to another host behind another interface.
+uint8_t arpEntryOnInterface(ARPTableEntry *p, NetInterface *n) {
+    return (p->iface == ARPAnyInterface) || (p->iface == (n - netInterfaces));
+}
+
+ARPTableEntry *findIpFromMac(NetInterface *n, uint8_t *mac) {
     ARPTableEntry *p = arpTable;
     while (p != NULL) {
-        if (isEqualMem(mac, p->mac, 6)) {
+        if (arpEntryOnInterface(p, n) && isEqualMem(mac, p->mac, 6)) {
             return p;
         }
         p = p->next;
@@ -128,10 +149,10 @@ ARPTableEntry *findIpFromMac(uint8_t *mac) {
     return NULL;
 }
 
-ARPTableEntry *findMacFromIp(IPv4Address ip) {
+ARPTableEntry *findMacFromIp(NetInterface *n, IPv4Address ip) {
     ARPTableEntry *p = arpTable;
     while (p != NULL) {
-        if (isEqualMem(ip, p->ip, 4)) {
+        if (arpEntryOnInterface(p, n) && isEqualMem(ip, p->ip, 4)) {
             return p;
         }
         p = p->next;
@@ -139,30 +160,102 @@ ARPTableEntry *findMacFromIp(IPv4Address ip) {
     return NULL;
 }
 
+// Unanswered requests expire after ARPTableTimeToRetry,
+// so the next lookup issues a new request.
+tick_t arpEntryLifetime(ARPTableEntry *p) {
+    if (isZero(p->mac, 6)) {
+        return ARPTableTimeToRetry;
+    }
+    return ARPTableTimeToLive;
+}
+
+// Arm arpTimer for the entry that expires first
+void arpArmTimer(void) {
+    tick_t now = getSystemTime(), age, min = SCHEDULER_IDLE;
+    for (ARPTableEntry *p = arpTable; p != NULL; p = p->next) {
+        age = diffTime(now, p->time);
+        if (age >= arpEntryLifetime(p)) {
+            min = 0;
+        } else if ((arpEntryLifetime(p) - age) < min) {
+            min = arpEntryLifetime(p) - age;
+        }
+    }
+    if (min == SCHEDULER_IDLE) {
+        timerCancel(&arpTimer);
+    } else {
+        timerStart(&arpTimer, min, 0);
+    }
+}
+
+// Clear old entries
+void arpAging(void) {
+    ARPTableEntry *p = arpTable;
+    ARPTableEntry *prev = NULL;
+    while (p != NULL) {
+        if (diffTime(getSystemTime(), p->time) >= arpEntryLifetime(p)) {
+            if (isZero(p->mac, 6)) {
+                // Nobody answered, don't hold buffers for it forever
+                ipv4DropUnresolved(p->iface, p->ip);
+            }
+            if (prev == NULL) {
+                arpTable = p->next;
+                slabFree(&arpSlab, p);
+                p = arpTable;
+            } else {
+                prev->next = p->next;
+                slabFree(&arpSlab, p);
+                p = prev->next;
+            }
+        } else {
+            prev = p;
+            p = p->next;
+        }
+    }
+    arpArmTimer();
+}
+
 ARPTableEntry *newEntry(void) {
-    ARPTableEntry *p = (ARPTableEntry *)mmalloc(sizeof(ARPTableEntry));
-    if (p != NULL) {
-        p->next = arpTable;
-        arpTable = p;
+    ARPTableEntry **l, **oldest = NULL;
+    tick_t now = getSystemTime();
+    ARPTableEntry *p = (ARPTableEntry *)slabAlloc(&arpSlab);
+    if (p == NULL) {
+        // Table is full, reuse the entry that was unused for the longest time
+        for (l = &arpTable; *l != NULL; l = &((*l)->next)) {
+            if ((oldest == NULL) || (diffTime(now, (*l)->time) > diffTime(now, (*oldest)->time))) {
+                oldest = l;
+            }
+        }
+        if (oldest == NULL) {
+            return NULL;
+        }
+        p = *oldest;
+        *oldest = p->next;
+        if (isZero(p->mac, 6)) {
+            taskPost(ipv4SendEvent); // Queued packets for this ip can ask again
+        }
     }
+    p->next = arpTable;
+    arpTable = p;
     return p;
 }
 
-void addMacIpPair(uint8_t *mac, uint8_t *ip) {
+void addMacIpPair(NetInterface *n, uint8_t *mac, uint8_t *ip, uint8_t create) {
     // Check if IP is already stored without MAC, copy MAC.
-    // Else, if the MAC is not stored, store it.
+    // Else, if the MAC is not stored and create is set, store it.
     uint8_t i;
 
-    if (isEqualMem(mac, ownMacAddress, 6) || isEqualMem(ip, ownIpAddress, 4)) {
+    if (isEqualMem(mac, n->mac, 6) || isEqualMem(ip, n->ip, 4)) {
         return;
     }
 
-    if (findMacFromIp(ip) != NULL) {
-        ARPTableEntry *t = findMacFromIp(ip);
+    if (findMacFromIp(n, ip) != NULL) {
+        ARPTableEntry *t = findMacFromIp(n, ip);
         for (i = 0; i < 6; i++) {
             t->mac[i] = mac[i];
         }
-    } else if (findIpFromMac(mac) == NULL) {
+        t->time = getSystemTime();
+        taskPost(ipv4SendEvent); // Queued packets can be sent now
+    } else if (create && (findIpFromMac(n, mac) == NULL)) {
         ARPTableEntry *t = newEntry();
         if (t != NULL) {
             for (i = 0; i < 6; i++) {
@@ -171,7 +264,9 @@ void addMacIpPair(uint8_t *mac, uint8_t *ip) {
                     t->ip[i] = ip[i];
                 }
             }
+            t->iface = n - netInterfaces;
             t->time = getSystemTime();
+            arpArmTimer();
         }
     }
 }
@@ -182,7 +277,8 @@ void addMacIpPair(uint8_t *mac, uint8_t *ip) {
 
 void arpInit(void) {
     uint8_t i;
-    arpTable = (ARPTableEntry *)mmalloc(sizeof(ARPTableEntry));
+    timerInit(&arpTimer, arpAging);
+    arpTable = (ARPTableEntry *)slabAlloc(&arpSlab);
     if (arpTable != NULL) {
         for (i = 0; i < 6; i++) {
             arpTable->mac[i] = 0xFF;
@@ -190,56 +286,69 @@ void arpInit(void) {
                 arpTable->ip[i] = 0xFF;
             }
         }
-        arpTable->time = 0;
+        arpTable->iface = ARPAnyInterface;
+        arpTable->time = getSystemTime();
         arpTable->next = NULL;
+        arpArmTimer();
     }
 }
 
 uint8_t arpProcessPacket(Packet *p) {
-    uint8_t i;
-
-    assert(p->dLength >= (ARPOffset + ARPPacketSize)); // Has correct length?
+    NetInterface *n = &netInterfaces[p->iface];
+    uint8_t i, forUs;
 
-    if (!(isEqualFlash(p->d + MACPreambleSize, ArpPacketHeader, HEADERLEN) && (p->dLength >= (HEADERLEN + 22 + MACPreambleSize)))) {
+    netCount(arp.rx);
+    if (!((packetEnd(p) >= (packetL3(p) + HEADERLEN + ARPPacketSize))
+            && isEqualFlash(packetL3(p), ArpPacketHeader, HEADERLEN))) {
         // Packet invalid
         debugPrint("ARP Packet not valid!\n");
-        mfree(p->d, p->dLength);
-        mfree(p, sizeof(Packet));
+        netCount(arp.invalid);
+        packetRelease(p);
         return 2;
     }
 
-    if (p->d[MACPreambleSize + HEADERLEN + 1] == 1) {
+#ifndef DISABLE_RATE_LIMIT
+    if (!tokenBucketTake(&arpBucket)) {
+        netCount(arp.shed);
+        packetRelease(p);
+        return 0;
+    }
+#endif
+
+    // Only hosts talking to us get a new table entry (RFC 826),
+    // an ARP scan of the network just updates the ones we know.
+    forUs = isEqualMem(n->ip, packetL3(p) + HEADERLEN + 18, 4);
+
+    if (packetL3(p)[HEADERLEN + 1] == 1) {
         // ARP Request
 
         // Sender MAC & IP
-        addMacIpPair(p->d + MACPreambleSize + HEADERLEN + 2, p->d + MACPreambleSize + HEADERLEN + 8);
+        addMacIpPair(n, packetL3(p) + HEADERLEN + 2, packetL3(p) + HEADERLEN + 8, forUs);
 
         // Check if the request is for us. If so, issue an answer!
-        if (isEqualMem(ownIpAddress, p->d + MACPreambleSize + HEADERLEN + 18, 4)) {
+        if (forUs) {
             debugPrint("ARP Request for us!");
-            p->d[MACPreambleSize + HEADERLEN + 1] = 2; // Reply
+            packetL3(p)[HEADERLEN + 1] = 2; // Reply
             for (i = 0; i < 6; i++) {
-                p->d[MACPreambleSize + HEADERLEN + 12 + i] = p->d[MACPreambleSize + HEADERLEN + 2 + i]; // Back to sender
-                p->d[MACPreambleSize + HEADERLEN + 2 + i] = ownMacAddress[i]; // Comes from us
-                p->d[i] = 255;
-                p->d[i + 6] = ownMacAddress[i];
-                p->d[12] = (ARP & 0xFF00) >> 8;
-                p->d[13] = (ARP & 0x00FF);
+                packetL3(p)[HEADERLEN + 12 + i] = packetL3(p)[HEADERLEN + 2 + i]; // Back to sender
+                packetL3(p)[HEADERLEN + 2 + i] = n->mac[i]; // Comes from us
                 if (i < 4) {
-                    p->d[MACPreambleSize + HEADERLEN + 18 + i] = p->d[MACPreambleSize + HEADERLEN + 8 + i];
+                    packetL3(p)[HEADERLEN + 18 + i] = packetL3(p)[HEADERLEN + 8 + i];
 
-                    p->d[MACPreambleSize + HEADERLEN + 8 + i] = ownIpAddress[i];
+                    packetL3(p)[HEADERLEN + 8 + i] = n->ip[i];
                 }
             }
+            // Without a VLAN tag, if the request had one
+            packetPull(p, p->l3 - packetHeadroom(p));
+            arpMacHeader(p);
             debugPrint(" Sending Response...");
             if (macSendPacket(p)) {
-                mfree(p->d, p->dLength);
-                mfree(p, sizeof(Packet));
+                packetRelease(p);
                 debugPrint(" Error!\n");
                 return 1;
             }
-            mfree(p->d, p->dLength);
-            mfree(p, sizeof(Packet));
+            netCount(arp.tx);
+            packetRelease(p);
             debugPrint(" Done!\n");
             return 0;
         } else {
@@ -247,33 +356,32 @@ uint8_t arpProcessPacket(Packet *p) {
 #if DEBUG >= 2
             debugPrint("ARP Request for ");
             for (i = 0; i < 4; i++) {
-                debugPrint(timeToString(p->d[MACPreambleSize + HEADERLEN + 18 + i]));
+                debugPrint(timeToString(packetL3(p)[HEADERLEN + 18 + i]));
                 if (i < 3) {
                     debugPrint(".");
                 }
             }
             debugPrint("\n");
 #endif
+            netCount(arp.notForUs);
         }
 
-        mfree(p->d, p->dLength);
-        mfree(p, sizeof(Packet));
+        packetRelease(p);
         return 0;
 
-    } else if (p->d[MACPreambleSize + HEADERLEN + 1] == 2) {
+    } else if (packetL3(p)[HEADERLEN + 1] == 2) {
         debugPrint("Got ARP Reply\n");
         // ARP Reply. Store the information, if not already present
         // Each packet contains two MAC-IP Combinations. Sender & Target
-        addMacIpPair(p->d + MACPreambleSize + HEADERLEN + 2, p->d + MACPreambleSize + HEADERLEN + 8);
-        addMacIpPair(p->d + MACPreambleSize + HEADERLEN + 12, p->d + MACPreambleSize + HEADERLEN + 18);
-        mfree(p->d, p->dLength);
-        mfree(p, sizeof(Packet));
+        addMacIpPair(n, packetL3(p) + HEADERLEN + 2, packetL3(p) + HEADERLEN + 8, forUs);
+        addMacIpPair(n, packetL3(p) + HEADERLEN + 12, packetL3(p) + HEADERLEN + 18, 0);
+        packetRelease(p);
         return 0;
     } else {
         // Neither request nor reply...
         debugPrint("Invalid ARP Packet Type!\n");
-        mfree(p->d, p->dLength);
-        mfree(p, sizeof(Packet));
+        netCount(arp.invalid);
+        packetRelease(p);
         return 2;
     }
     return 0;
@@ -281,28 +389,10 @@ uint8_t arpProcessPacket(Packet *p) {
 
 // Searches in ARP Table. If entry is found, return non-alloced buffer
 // with mac address and update the time of the entry.
-uint8_t *arpGetMacFromIp(IPv4Address ip) {
-    // Clear old entries
-    ARPTableEntry *p = arpTable;
-    ARPTableEntry *prev = NULL;
-    while (p != NULL) {
-        if ((p->time + ARPTableTimeToLive) <= getSystemTime()) {
-            if (prev == NULL) {
-                arpTable = p->next;
-                mfree(p, sizeof(ARPTableEntry));
-                p = arpTable;
-            } else {
-                prev->next = p->next;
-                mfree(p, sizeof(ARPTableEntry));
-                p = prev->next;
-            }
-        } else {
-            prev = p;
-            p = p->next;
-        }
-    }
+uint8_t *arpGetMacFromIp(NetInterface *n, IPv4Address ip) {
+    ARPTableEntry *p;
 
-    if (!isIpInThisNetwork(ip)) {
+    if (!isIpInThisNetwork(n, ip)) {
 #if DEBUG >= 1
         debugPrint("ARP Cache Request for IP: ");
         for (i = 0; i < 4; i++) {
@@ -313,21 +403,15 @@ uint8_t *arpGetMacFromIp(IPv4Address ip) {
         }
         debugPrint("\nRedirecting to default Gateway...\n");
 #endif
-        return arpGetMacFromIp(defaultGateway);
+        return arpGetMacFromIp(n, n->gateway);
     }
 
-    p = findMacFromIp(ip);
+    p = findMacFromIp(n, ip);
     if (p != NULL) {
         if (isZero(p->mac, 6)) {
-            // We're waiting for an answer
-            if ((p->time + ARPTableTimeToRetry) <= getSystemTime()) {
-                // Waiting too long, re-issue request
-                sendArpRequest(ip);
-                return NULL;
-            } else {
-                // Requested, but not yet answered
-                return NULL;
-            }
+            // Requested, but not yet answered. arpTimer removes
+            // the entry after ARPTableTimeToRetry, then we ask again.
+            return NULL;
         } else {
             // Answer is present
             for (uint8_t i = 0; i < 6; i++) {
@@ -348,8 +432,10 @@ uint8_t *arpGetMacFromIp(IPv4Address ip) {
                 p->ip[i] = ip[i];
             }
         }
+        p->iface = n - netInterfaces;
         p->time = getSystemTime();
-        sendArpRequest(ip);
+        arpArmTimer();
+        sendArpRequest(n, ip);
         return NULL;
     }
 }
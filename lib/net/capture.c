@@ -0,0 +1,292 @@
+/*
+ * capture.c
+ *
+ * Copyright (c) 2012, Thomas Buck <xythobuz@me.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <avr/io.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#define DEBUG 0
+
+#include <std.h>
+#include <time.h>
+#include <serial.h>
+#include <net/utils.h>
+#include <net/udp.h>
+#include <net/capture.h>
+#include <net/controller.h>
+
+#ifndef DISABLE_CAPTURE
+
+#define RECORDHEADER 8 // In the ring: included and original length, time in us
+#define PCAPHEADER 16 // Record header in the pcap stream
+#define PCAPDATAGRAM (PacketMaxLength - UDPHeadroom) // Biggest UDP payload
+
+uint8_t captureActive = 0;
+CaptureStats captureStats;
+
+uint8_t captureRing[CaptureRingSize];
+uint16_t captureHead = 0; // Next byte written
+uint16_t captureTail = 0; // Next byte read
+uint16_t captureUsed = 0;
+
+uint8_t captureOutput;
+CaptureFilter captureFilter;
+uint16_t captureSnapLength;
+IPv4Address captureIp;
+uint16_t capturePort;
+
+// ----------------------
+// |    Internal API    |
+// ----------------------
+
+void ringPut(uint8_t c) {
+    captureRing[captureHead] = c;
+    if (++captureHead >= CaptureRingSize) {
+        captureHead = 0;
+    }
+    captureUsed++;
+}
+
+uint8_t ringGet(void) {
+    uint8_t c = captureRing[captureTail];
+    if (++captureTail >= CaptureRingSize) {
+        captureTail = 0;
+    }
+    captureUsed--;
+    return c;
+}
+
+// Byte i behind the tail, without removing it
+uint8_t ringPeek(uint16_t i) {
+    i += captureTail;
+    if (i >= CaptureRingSize) {
+        i -= CaptureRingSize;
+    }
+    return captureRing[i];
+}
+
+uint32_t ringGet32(uint8_t bytes) {
+    uint32_t v = 0;
+    for (uint8_t i = 0; i < bytes; i++) {
+        v |= ((uint32_t)ringGet()) << (8 * i);
+    }
+    return v;
+}
+
+// pcap is little endian, like the AVR
+void put32(uint8_t *d, uint32_t v) {
+    for (uint8_t i = 0; i < 4; i++) {
+        d[i] = v & 0xFF;
+        v >>= 8;
+    }
+}
+
+// Takes the ring header of the oldest record and converts it to a
+// pcap record header in h. Returns the number of data bytes following.
+uint16_t recordHeader(uint8_t *h) {
+    uint16_t included = ringGet32(2);
+    uint16_t original = ringGet32(2);
+    uint32_t time = ringGet32(4);
+    time_t now = getUptime() * 1000;
+    // time wraps after 71 minutes, records are never that old
+    now -= (int32_t)((uint32_t)now - time);
+    put32(h, now / 1000000); // Seconds
+    put32(h + 4, now % 1000000); // Microseconds
+    put32(h + 8, included);
+    put32(h + 12, original);
+    return included;
+}
+
+// Datagrams carrying our own records must not be captured again
+uint8_t isCaptureTraffic(Packet *p) {
+#ifndef DISABLE_UDP
+    if ((captureOutput == CAPTURE_UDP) && (p->dLength >= UDPHeadroom)
+            && is16BitEqual(p->d, MACTypeOffset, IPV4)
+            && (p->d[MACPreambleSize + IPv4PacketProtocolOffset] == UDP)
+            && isEqualMem(p->d + MACPreambleSize + IPv4PacketDestinationOffset, captureIp, 4)
+            && is16BitEqual(p->d, IPv4Headroom + UDPDestinationOffset, capturePort)) {
+        return 1;
+    }
+#endif
+    return 0;
+}
+
+// ----------------------
+// |    External API    |
+// ----------------------
+
+void captureStart(uint8_t output, CaptureFilter filter, uint16_t snapLength,
+        uint8_t *ip, uint16_t port) {
+    uint16_t max = CaptureRingSize - RECORDHEADER;
+    uint8_t h[PCAPHEADER + 8], i;
+
+#ifdef DISABLE_UDP
+    output = CAPTURE_SERIAL;
+#endif
+    if ((output == CAPTURE_UDP) && (max > (PCAPDATAGRAM - PCAPHEADER))) {
+        max = PCAPDATAGRAM - PCAPHEADER; // Every record fits in a datagram
+    }
+    if ((snapLength == 0) || (snapLength > max)) {
+        snapLength = max;
+    }
+
+    captureActive = 0;
+    captureHead = 0;
+    captureTail = 0;
+    captureUsed = 0;
+    captureStats.captured = 0;
+    captureStats.dropped = 0;
+    captureStats.sendFailed = 0;
+    captureOutput = output;
+    captureFilter = filter;
+    captureSnapLength = snapLength;
+    if (ip != NULL) {
+        for (i = 0; i < 4; i++) {
+            captureIp[i] = ip[i];
+        }
+    }
+    capturePort = port;
+
+    if (output == CAPTURE_SERIAL) {
+        // pcap file header. pcapReceiver writes it for UDP.
+        put32(h, 0xA1B2C3D4); // Magic
+        put32(h + 4, 0x00040002); // Version 2.4
+        put32(h + 8, 0); // Timezone
+        put32(h + 12, 0); // Timestamp accuracy
+        put32(h + 16, snapLength);
+        put32(h + 20, 1); // Ethernet
+        for (i = 0; i < sizeof(h); i++) {
+            serialWrite(h[i]);
+        }
+    }
+    captureActive = 1;
+}
+
+void captureStop(void) {
+    captureActive = 0; // captureSend still empties the ring
+}
+
+void captureFrame(Packet *p, uint8_t direction) {
+    uint16_t length = packetLength(p), included, i;
+    uint32_t time;
+    PacketSegment *s;
+
+    if ((direction == CAPTURE_TX) && isCaptureTraffic(p)) {
+        return;
+    }
+    if ((captureFilter != NULL) && !captureFilter(p, direction)) {
+        return;
+    }
+
+    // Received frames were stamped when the MAC was read
+    time = (direction == CAPTURE_RX) ? p->time : getSystemTimeUs();
+    included = (length > captureSnapLength) ? captureSnapLength : length;
+    if ((CaptureRingSize - captureUsed) < (RECORDHEADER + included)) {
+        captureStats.dropped++;
+        return;
+    }
+
+    ringPut(included & 0xFF);
+    ringPut(included >> 8);
+    ringPut(length & 0xFF);
+    ringPut(length >> 8);
+    for (i = 0; i < 4; i++) {
+        ringPut(time & 0xFF);
+        time >>= 8;
+    }
+    for (i = 0; (i < p->dLength) && (included > 0); i++, included--) {
+        ringPut(p->d[i]);
+    }
+    for (s = p->chain; (s != NULL) && (included > 0); s = s->next) {
+        for (i = 0; (i < s->length) && (included > 0); i++, included--) {
+            ringPut(segmentByte(s, i));
+        }
+    }
+    captureStats.captured++;
+}
+
+uint8_t captureHasData(void) {
+    return (captureUsed > 0);
+}
+
+void captureSend(void) {
+    uint8_t h[PCAPHEADER];
+    uint16_t included, i;
+#ifndef DISABLE_UDP
+    uint16_t length = 0, records = 0;
+    uint8_t *d;
+    Packet *p;
+#endif
+
+    if (captureOutput == CAPTURE_SERIAL) {
+        // One record per call, serialWrite() waits if the buffer is full
+        included = recordHeader(h);
+        for (i = 0; i < PCAPHEADER; i++) {
+            serialWrite(h[i]);
+        }
+        for (i = 0; i < included; i++) {
+            serialWrite(ringGet());
+        }
+        return;
+    }
+
+#ifndef DISABLE_UDP
+    // As many complete records as fit into one datagram
+    while (records < captureUsed) {
+        included = ringPeek(records) | (ringPeek(records + 1) << 8);
+        if ((length + PCAPHEADER + included) > PCAPDATAGRAM) {
+            break;
+        }
+        length += PCAPHEADER + included;
+        records += RECORDHEADER + included;
+    }
+
+    p = udpAllocPacket(length);
+    if (p == NULL) {
+        // Waiting would keep the pool busy, make room for new records
+        captureStats.sendFailed++;
+        for (; records > 0; records--) {
+            ringGet();
+        }
+        return;
+    }
+    d = p->d;
+    while (records > 0) {
+        included = recordHeader(d);
+        d += PCAPHEADER;
+        for (i = 0; i < included; i++) {
+            *(d++) = ringGet();
+        }
+        records -= RECORDHEADER + included;
+    }
+    udpSendPacket(p, captureIp, capturePort, capturePort);
+#endif
+}
+
+#endif // DISABLE_CAPTURE
@@ -52,13 +52,59 @@
 #include <net/dhcp.h>
 #include <net/dns.h>
 #include <net/ntp.h>
+#include <net/utils.h>
+#include <net/stats.h>
+#include <net/capture.h>
 #include <net/controller.h>
 
 uint8_t networkHandler(void);
+uint8_t netHasInterrupt(void);
+void networkIdle(void);
 
 char buff[BUFFSIZE];
 uint16_t tl = 0;
 
+#ifndef DISABLE_NET_STATS
+NetStats netStats;
+
+void netStatsReset(void) {
+    memset(&netStats, 0, sizeof(netStats));
+}
+#endif
+
+NetInterface netInterfaces[NetMaxInterfaces];
+uint8_t netInterfaceCount = 0;
+uint8_t rxInterface = 0; // Polled first by networkHandler
+uint8_t rxStalled = 0; // A received frame waits in the MAC for a buffer
+uint8_t rxStallAvailable = 0; // packetAvailable() when it found none
+
+#ifdef TIMER_TICKLESS
+uint8_t macCanWakeUp = 0; // All interfaces can wake us up
+#endif
+
+STATIC_TASKS(networkTasks,
+    // Enable polling, received packets are handled before application tasks
+    TASK((Task)networkHandler, netHasInterrupt, "Poll", TASK_PRIORITY_HIGH),
+    // Enable transmission
+    EVENT_TASK(ipv4SendQueue, "Send", TASK_PRIORITY_HIGH, &ipv4SendEvent),
+    // Receive packets sent to ourselves
+    EVENT_TASK(ipv4LoopbackQueue, "Loop", TASK_PRIORITY_HIGH, &ipv4LoopbackEvent),
+#ifndef DISABLE_CAPTURE
+    // Stream captured frames, when nothing else is to be done
+    TASK(captureSend, captureHasData, "Capture", TASK_PRIORITY_LOW),
+#endif
+);
+
+// Sorted by ethertype!
+PROTOCOL_TABLE(ethertypes, EthertypeMaxHandlers,
+    { IPV4, ipv4ProcessPacket },
+    { ARP, arpProcessPacket }
+);
+
+#ifndef DISABLE_RATE_LIMIT
+TokenBucket broadcastBucket = TOKEN_BUCKET(BroadcastRateLimit, BroadcastBurst);
+#endif
+
 char *timeToString(time_t s) {
     return ultoa(s, buff, 10);
 }
@@ -99,34 +145,25 @@ char *typeString(uint16_t t) {
 #if DEBUG >= 3
 uint8_t debugUdpHandler(Packet *p) {
     uint16_t i, max;
-    max = get16Bit(p->d, UDPOffset + UDPLengthOffset);
+    max = get16Bit(packetL4(p), UDPLengthOffset) - UDPDataOffset;
     debugPrint("UDP Debug: ");
     for (i = 0; i < max; i++) {
-        serialWrite(p->d[UDPOffset + UDPDataOffset + i]);
+        serialWrite(packetL4(p)[UDPDataOffset + i]);
         if (i < (max - 1)) {
             debugPrint(" ");
         }
     }
     debugPrint("\n");
+    packetRelease(p);
     return 0;
 }
 #endif
 
-void networkInit(uint8_t *mac, uint8_t *ip, uint8_t *subnet, uint8_t *gateway) {
+void networkInit(const MacDriver *driver, uint8_t *mac, uint8_t *ip, uint8_t *subnet, uint8_t *gateway) {
     debugPrint("Net Init\n");
-    macInitialize(mac);
-#if DEBUG >= 1
-    debugPrint("Hardware Driver initialized: ");
-    for (uint8_t i = 0; i < 6; i++) {
-        debugPrint(hex2ToString(mac[i]));
-        if (i < 5) {
-            debugPrint("-");
-        }
-    }
-    debugPrint("\n");
-#endif
+    packetInit();
     arpInit();
-    ipv4Init(ip, subnet, gateway);
+    netInterfaceAdd(driver, mac, ip, subnet, gateway);
 
 #ifndef DISABLE_ICMP
     icmpInit();
@@ -150,46 +187,201 @@ void networkInit(uint8_t *mac, uint8_t *ip, uint8_t *subnet, uint8_t *gateway) {
 #endif
 #endif // DISABLE_UDP
 
-    addTask((Task)networkHandler, macHasInterrupt, "Poll"); // Enable polling
-    addTask(ipv4SendQueue, ipv4PacketsToSend, "Send"); // Enable transmission
+    registerStaticTasks(networkTasks);
+    stackCheckStart(); // Watermark for every application
 
 #ifndef DISABLE_NTP
     // addTimedTask((Task)ntpIssueRequest, 1000, 0);
 #endif
 }
 
+void networkIdle(void) {
+#ifdef TIMER_TICKLESS
+    // Sleep until the next timed task is due, an interrupt
+    // occurs or the MAC has to be polled again.
+    tick_t d = schedulerNextDeadline();
+    if (tasksPending()) {
+        return; // Posted after tasks() looked
+    }
+    if ((!macCanWakeUp) && (d > MACPollInterval)) {
+        d = MACPollInterval;
+    }
+    if (d > 0) {
+        timerSleep(d);
+    }
+#endif
+}
+
 void networkLoop(void) {
     // Run the tasks
     scheduler();
     wdt_reset();
-    tasks();
+    if (tasks() == 0) {
+        networkIdle(); // Nothing to do
+    }
     wdt_reset();
 }
 
+uint8_t networkRegisterHandler(uint16_t ethertype, PacketHandler handler) {
+    return protocolRegister(&ethertypes, ethertype, handler);
+}
+
+uint8_t netInterfaceAdd(const MacDriver *driver, uint8_t *mac, uint8_t *ip, uint8_t *subnet, uint8_t *gateway) {
+    NetInterface *n = &netInterfaces[netInterfaceCount];
+    uint8_t i;
+
+    if (netInterfaceCount >= NetMaxInterfaces) {
+        return 1;
+    }
+    n->driver = driver;
+    for (i = 0; i < 6; i++) {
+        n->mac[i] = mac[i];
+    }
+    if (driver->initialize(n->mac)) {
+        debugPrint("Hardware Driver failed!\n");
+        return 1;
+    }
+    for (i = 0; i < 6; i++) {
+        mac[i] = n->mac[i]; // Some drivers read it from the chip
+    }
+#if DEBUG >= 1
+    debugPrint("Hardware Driver initialized: ");
+    for (i = 0; i < 6; i++) {
+        debugPrint(hex2ToString(mac[i]));
+        if (i < 5) {
+            debugPrint("-");
+        }
+    }
+    debugPrint("\n");
+#endif
+    ipv4Init(n, ip, subnet, gateway);
+
+#ifdef TIMER_TICKLESS
+    i = driver->enableWakeup();
+    macCanWakeUp = (netInterfaceCount == 0) ? i : (macCanWakeUp && i);
+#endif
+    netInterfaceCount++;
+    return 0;
+}
+
+NetInterface *netRoute(uint8_t *ip) {
+    NetInterface *n, *r = NULL;
+    uint8_t i;
+
+    if (netInterfaceCount < 2) {
+        return netInterfaces; // Nothing to choose from
+    }
+    for (n = netInterfaces; n < (netInterfaces + netInterfaceCount); n++) {
+        if (!n->driver->linkIsUp()) {
+            continue;
+        }
+        for (i = 0; (i < 4) && ((ip[i] & n->subnet[i]) == (n->ip[i] & n->subnet[i])); i++);
+        if (i == 4) {
+            return n; // Directly reachable
+        }
+        if (r == NULL) {
+            r = n; // Default route over the first link that is up
+        }
+    }
+    if (r == NULL) {
+        return netInterfaces; // Everything is down, doesn't matter
+    }
+    return r;
+}
+
+uint8_t netHasInterrupt(void) {
+    if (rxStalled && (packetAvailable() <= rxStallAvailable)) {
+        return 0; // Polling again won't help until a buffer is released
+    }
+    for (uint8_t i = 0; i < netInterfaceCount; i++) {
+        if (netInterfaces[i].driver->hasInterrupt()) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+uint8_t macSendPacket(Packet *p) {
+    const MacDriver *d = netInterfaces[p->iface].driver;
+    uint8_t r;
+    captureHook(p, CAPTURE_TX);
+    if ((p->chain != NULL) && !d->segments) {
+        // The caller keeps its reference, we send a flat copy
+        Packet *c = packetCopy(packetRetain(p));
+        if (c == NULL) {
+            netCount(mac.txError);
+            return 1;
+        }
+        r = d->sendPacket(c);
+        packetRelease(c);
+    } else {
+        r = d->sendPacket(p);
+    }
+    if (r) {
+        netCount(mac.txError);
+        return 1;
+    }
+    netCount(mac.tx);
+    return 0;
+}
+
 uint8_t networkHandler(void) {
     Packet *p;
+    PacketHandler h;
+    NetInterface *n = NULL;
+    uint32_t t;
+    uint16_t e;
+    uint8_t i, iface = 0;
+
+    // Take turns, so a busy interface can't starve the others
+    for (i = 0; i < netInterfaceCount; i++) {
+        iface = rxInterface;
+        n = &netInterfaces[iface];
+        if (++rxInterface >= netInterfaceCount) {
+            rxInterface = 0;
+        }
+        if (n->driver->linkIsUp() && (n->driver->packetsReceived() > 0)) {
+            break;
+        }
+    }
 
-    if (macLinkIsUp() && (macPacketsReceived() > 0)) {
-        p = macGetPacket();
+    if (i < netInterfaceCount) {
+        t = getSystemTimeUs(); // Before reading it from the MAC
+        e = packetExhausted();
+        p = n->driver->getPacket();
 
         if (p == NULL) {
+            if (packetExhausted() != e) {
+                // No buffer, the MAC keeps it or drops it. Count it only once.
+                if (!rxStalled) {
+                    netCount(mac.rxStalled);
+                    rxStalled = 1;
+                }
+                rxStallAvailable = packetAvailable();
+                return 1;
+            }
             debugPrint("Error while receiving!\n");
+            netCount(mac.rxError);
             return 1;
         }
+        rxStalled = 0;
+        netCount(mac.rx);
 
         assert(p->dLength > 0);
         assert(p->dLength <= MaxPacketSize);
+        p->time = t;
+        p->iface = iface;
+        captureHook(p, CAPTURE_RX);
 
-        if (p->d == NULL) {
-            debugPrint("Not enough memory to receive packet with ");
-            debugPrint(timeToString(p->dLength));
-            debugPrint(" bytes!\n");
-            mfree(p, sizeof(Packet));
-            return 1;
+        // Network layer header follows the MAC header
+        p->l3 = MACPreambleSize;
+        tl = get16Bit(p->d, MACTypeOffset);
+        if ((tl == VLAN) && (p->dLength > (MACPreambleSize + MACVLANTagSize))) {
+            // We ignore the VLAN ID, only skip the tag
+            p->l3 += MACVLANTagSize;
+            tl = get16Bit(p->d, MACTypeOffset + MACVLANTagSize);
         }
 
-        tl = get16Bit(p->d, 12);
-
 #if DEBUG >= 2
         debugPrint(timeToString(getSystemTimeSeconds()));
         debugPrint(" - ");
@@ -199,25 +391,25 @@ uint8_t networkHandler(void) {
         debugPrint(" bytes Received!\n");
 #endif
 
-        if (tl == IPV4) {
-            // IPv4 Packet
-            return ipv4ProcessPacket(p);
-        } else if (tl == ARP) {
-            // Address Resolution Protocol Packet
-            return arpProcessPacket(p);
-        } else if (tl == WOL) {
-            // Wake on Lan Packet
-        } else if (tl == RARP) {
-            // Reverse Address Resolution Protocol Packet
-        } else if (tl <= 0x0600) {
-            // Ethernet type I packet. typeLength = Real data length
-        } else if (tl == IPV6) {
-            // IPv6 Packet
+#ifndef DISABLE_RATE_LIMIT
+        // ARP requests are broadcasts, too, but have their own limit
+        if ((p->d[0] & 0x01) && (tl != ARP) && !tokenBucketTake(&broadcastBucket)) {
+            debugPrint("Broadcast over limit!\n");
+            netCount(mac.shed);
+            packetRelease(p);
+            return 0;
+        }
+#endif
+
+        // Values up to 0x0600 are the length of an Ethernet type I packet
+        h = protocolFind(&ethertypes, tl);
+        if (h != NULL) {
+            return h(p);
         }
+        netCount(mac.noHandler);
 
         // Packet unhandled, free it
-        mfree(p->d, p->dLength);
-        mfree(p, sizeof(Packet));
+        packetRelease(p);
         return 42;
     }
     return 0xFF;
@@ -65,9 +65,9 @@ uint16_t dnsCacheSize(void) {
     return i;
 }
 
-time_t dnsOldestEntry(void) { // Returns UINT64_MAX if no entries...
+tick_t dnsOldestEntry(void) { // Returns UINT32_MAX if no entries...
     DnsTableEntry *d = dnsTable;
-    time_t min = UINT64_MAX;
+    tick_t min = UINT32_MAX;
     while (d != NULL) {
         if (d->time < min) {
             min = d->time;
@@ -81,7 +81,6 @@ time_t dnsOldestEntry(void) { // Returns UINT64_MAX if no entries...
 
 
 
-#ifndef DISABLE_DNS_DOMAIN_VALIDATION
 uint8_t stringContains(uint8_t *s, uint8_t c) {
     uint8_t count = 0;
     while (*s != '\0') {
@@ -90,7 +89,6 @@ uint8_t stringContains(uint8_t *s, uint8_t c) {
     }
     return count;
 }
-#endif
 
 uint8_t stringPartLength(uint8_t *s, uint8_t c, uint8_t part) {
     uint8_t curPart = 0, count = 0;
@@ -118,19 +116,21 @@ void stringCopyPart(uint8_t *s, uint8_t c, uint8_t part, uint8_t *d, uint8_t siz
     }
 }
 
-uint8_t *toDnsName(uint8_t *domain) {
+// Writes the name into a buffer with length bytes.
+// Returns the size of the name, 0 if it is invalid or does not fit.
+uint8_t toDnsName(uint8_t *domain, uint8_t *name, uint8_t length) {
     // Give it something like "www.google.com" to receive:
     // 3"www"6"google"3"com"0
     // to use as name in a dns request
     uint8_t parts, size, v, i, p, sum = 1; // Null byte at end
-    uint8_t *name;
+    parts = stringContains(domain, '.');
 #ifndef DISABLE_DNS_DOMAIN_VALIDATION
-    if ((parts = stringContains(domain, '.')) == 0) {
-        return NULL; // Contains no dot...
+    if (parts == 0) {
+        return 0; // Contains no dot...
     }
     if (strstr((char *)domain, "..") != NULL) {
         // There are two dots after another in this domain
-        return NULL;
+        return 0;
     }
 #endif
     parts++;
@@ -138,9 +138,8 @@ uint8_t *toDnsName(uint8_t *domain) {
         v = stringPartLength(domain, '.', i);
         sum += v + 1; // length byte
     }
-    name = (uint8_t *)mmalloc(sum * sizeof(uint8_t));
-    if (name == NULL) {
-        return NULL; // No memory
+    if (sum > length) {
+        return 0; // Does not fit
     }
     p = 0;
     for (i = 0; i < parts; i++) {
@@ -151,7 +150,7 @@ uint8_t *toDnsName(uint8_t *domain) {
         p += size;
     }
     name[p] = 0; // last null byte
-    return name;
+    return sum;
 }
 
 // --------------------------
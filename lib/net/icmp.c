@@ -43,6 +43,7 @@
 #include <std.h>
 #include <net/utils.h>
 #include <net/icmp.h>
+#include <net/stats.h>
 #include <serial.h>
 #include <net/controller.h>
 
@@ -50,6 +51,10 @@
 
 void (*echoHandler)(Packet *) = NULL;
 
+#ifndef DISABLE_RATE_LIMIT
+TokenBucket icmpBucket = TOKEN_BUCKET(ICMPRateLimit, ICMPBurst);
+#endif
+
 #if DEBUG >= 2
 char *icmpMessage(uint8_t type, uint8_t code);
 #endif
@@ -65,59 +70,45 @@ uint16_t icmpChecksum(Packet *p) {
 #if DEBUG >= 3
     uint16_t i;
     debugPrint("Length: ");
-    debugPrint(timeToString(p->dLength));
-    debugPrint(" - ");
-    debugPrint(timeToString(ICMPOffset));
-    debugPrint(" = ");
-    debugPrint(timeToString(p->dLength - ICMPOffset));
+    debugPrint(timeToString(packetL4Length(p)));
     debugPrint("\nICMP Packet Data:\n");
-    for (i = 0; i < p->dLength - ICMPOffset; i++) {
-        debugPrint(hexToString(p->d[ICMPOffset + i]));
-        if (i < (p->dLength - ICMPOffset - 1)) {
+    for (i = 0; i < packetL4Length(p); i++) {
+        debugPrint(hexToString(packetL4(p)[i]));
+        if (i < (packetL4Length(p) - 1)) {
             debugPrint(" ");
         }
     }
     debugPrint("\n");
 #endif
-    return checksum(p->d + ICMPOffset, p->dLength - ICMPOffset);
+    return checksum(packetL4(p), packetL4Length(p));
 }
 #endif // DISABLE_ICMP_CHECKSUM
 
 #ifndef DISABLE_ICMP_ECHO
 uint8_t icmpAnswerEcho(Packet *p) {
     // Just change type to zero, recompute checksum, send.
-    uint8_t i;
-    uint8_t *po;
+    uint8_t i, tos = packetL3(p)[IPv4PacketTosOffset];
     IPv4Address target;
     uint16_t cs = 0x0000;
     for (i = 0; i < 4; i++) {
         // Get Target IP
-        target[i] = p->d[MACPreambleSize + IPv4PacketSourceOffset + i];
-    }
-    p->d[ICMPOffset] = 0x00; // Echo Reply
-    p->d[ICMPOffset + 2] = 0;
-    p->d[ICMPOffset + 3] = 0; // Clear Checksum Field
-
-    if (p->dLength > ICMPOffset + ICMPPacketSize + 4) {
-        // We strip the last 4 bytes from the icmp payload
-        // To be honest, i don't know why, but ping
-        // is reporting a wrong total length otherwise...
-        po = mrealloc(p->d, p->dLength - 4, p->dLength);
-        if (po != NULL) {
-            p->d = po;
-        }
-        p->dLength -= 4;
+        target[i] = packetL3(p)[IPv4PacketSourceOffset + i];
     }
+    packetL4(p)[0] = 0x00; // Echo Reply
+    packetL4(p)[2] = 0;
+    packetL4(p)[3] = 0; // Clear Checksum Field
 
 #ifndef DISABLE_ICMP_CHECKSUM
     cs = icmpChecksum(p);
 #else
     // Checksum field was not cleared...
-    cs = get16Bit(p->d, ICMPOffset + 2) - 0x0800;
+    cs = get16Bit(packetL4(p), 2) - 0x0800;
 #endif
-    p->d[ICMPOffset + 2] = (cs & 0xFF00) >> 8;
-    p->d[ICMPOffset + 3] = (cs & 0x00FF);
-    return ipv4SendPacket(p, target, ICMP);
+    packetL4(p)[2] = (cs & 0xFF00) >> 8;
+    packetL4(p)[3] = (cs & 0x00FF);
+    packetPull(p, packetL4(p) - p->d); // Reuse the received headers' space
+    netCount(icmp.tx);
+    return ipv4SendPacket(p, target, ICMP, tos, IPV4_CLASS_CONTROL); // Same TOS as the request
 }
 #endif // DISABLE_ICMP_ECHO
 
@@ -135,8 +126,24 @@ uint8_t icmpProcessPacket(Packet *p) {
     uint16_t cs, ocs;
 #endif
 
-    type = p->d[ICMPOffset];
-    code = p->d[ICMPOffset + 1];
+    netCount(icmp.rx);
+    if (packetL4Length(p) < ICMPPacketSize) {
+        netCount(icmp.invalid);
+        packetRelease(p);
+        return 2;
+    }
+
+#ifndef DISABLE_RATE_LIMIT
+    // Before the checksum and before we answer
+    if (!tokenBucketTake(&icmpBucket)) {
+        netCount(icmp.shed);
+        packetRelease(p);
+        return 0;
+    }
+#endif
+
+    type = packetL4(p)[0];
+    code = packetL4(p)[1];
 
 #if DEBUG >= 2
     debugPrint(icmpMessage(type, code));
@@ -144,9 +151,9 @@ uint8_t icmpProcessPacket(Packet *p) {
 #endif
 
 #ifndef DISABLE_ICMP_CHECKSUM
-    ocs = get16Bit(p->d, ICMPOffset + 2); // Store Checksum
-    p->d[ICMPOffset + 2] = 0;
-    p->d[ICMPOffset + 3] = 0; // Clear Checksum Field
+    ocs = get16Bit(packetL4(p), 2); // Store Checksum
+    packetL4(p)[2] = 0;
+    packetL4(p)[3] = 0; // Clear Checksum Field
     cs = icmpChecksum(p); // Calculate Checksum
     if (cs != ocs) {
 #if DEBUG >= 1
@@ -156,9 +163,9 @@ uint8_t icmpProcessPacket(Packet *p) {
         debugPrint(hexToString(ocs));
         debugPrint("\n");
 #endif
+        netCount(icmp.checksum);
 #ifndef ICMP_CHECKSUM_DONT_CARE
-        mfree(p->d, p->dLength);
-        mfree(p, sizeof(Packet));
+        packetRelease(p);
         return 2; // Invalid
 #endif
     } else {
@@ -176,11 +183,10 @@ uint8_t icmpProcessPacket(Packet *p) {
 
     if ((type == 0) && (code == 0) && (echoHandler != NULL)) {
         echoHandler(p);
-        return 0; // echoHandler has to free p
+        return 0; // echoHandler has to release p
     }
 
-    mfree(p->d, p->dLength);
-    mfree(p, sizeof(Packet));
+    packetRelease(p);
     return 0;
 }
 
@@ -190,29 +196,25 @@ void registerEchoReplyHandler(void (*func)(Packet *)) {
 
 void sendEchoRequest(uint8_t *ip) {
     uint16_t cs;
-    Packet *p = (Packet *)mmalloc(sizeof(Packet));
+    Packet *p = packetAllocHeadroom(IPv4Headroom, ICMPPacketSize + 4);
     if (p == NULL) {
+        netCount(icmp.noMemory);
         return;
     }
-    p->dLength = ICMPOffset + ICMPPacketSize + 4;
-    p->d = (uint8_t *)mmalloc(p->dLength);
-    if (p->d == NULL) {
-        mfree(p, sizeof(Packet));
-        return;
-    }
-    p->d[ICMPOffset] = 8; // Type
-    p->d[ICMPOffset + 1] = 0; // Code
-    p->d[ICMPOffset + 2] = 0;
-    p->d[ICMPOffset + 3] = 0; // Clear checksum field
+    packetL4(p)[0] = 8; // Type
+    packetL4(p)[1] = 0; // Code
+    packetL4(p)[2] = 0;
+    packetL4(p)[3] = 0; // Clear checksum field
     // We fill the echo id with random data...
     for (cs = 0; cs < 4; cs++) {
-        p->d[ICMPOffset + 4 + cs] = (uint8_t)(rand() & 0xFF);
+        packetL4(p)[4 + cs] = (uint8_t)(rand() & 0xFF);
     }
 #ifndef DISABLE_ICMP_CHECKSUM
     cs = icmpChecksum(p);
-    set16Bit(p->d, ICMPOffset + 2, cs);
+    set16Bit(packetL4(p), 2, cs);
 #endif
-    ipv4SendPacket(p, ip, ICMP);
+    netCount(icmp.tx);
+    ipv4SendPacket(p, ip, ICMP, IPV4_TOS_DEFAULT, IPV4_CLASS_CONTROL);
 }
 
 // ----------------------
@@ -37,6 +37,9 @@
 // 3 for error messages
 
 #include <std.h>
+#include <slab.h>
+#include <tasks.h>
+#include <scheduler.h>
 #include <time.h>
 #include <net/mac.h>
 #include <net/arp.h>
@@ -45,30 +48,53 @@
 #include <net/icmp.h>
 #include <net/udp.h>
 #include <net/utils.h>
-
-IPv4Address ownIpAddress;
-IPv4Address subnetmask;
-IPv4Address defaultGateway;
+#include <net/stats.h>
 
 uint16_t risingIdentification = 1;
 
-// Transmission Buffer, single-linked-list
+// Transmission Buffer, one single-linked-list per class, oldest first
 typedef struct IpElement IpElement;
 struct IpElement {
     Packet *p;
     IpElement *next;
 };
-IpElement *transmissionBuffer = NULL;
+IpElement *transmissionBuffer[IPV4_CLASSES] = { NULL, NULL, NULL };
+uint8_t transmissionDepth[IPV4_CLASSES] = { 0, 0, 0 };
+const uint8_t transmissionMaxDepth[IPV4_CLASSES] = {
+    IPv4QueueDepthControl, IPv4QueueDepthInteractive, IPv4QueueDepthBulk
+};
+IpElement *loopbackBuffer = NULL; // Packets to ourselves, oldest first
+SLAB(ipv4QueueSlab, IpElement, IPv4MaxQueueSize);
+
+#if IPv4MaxQueueSize >= (PacketPoolSmallCount + PacketPoolMediumCount + PacketPoolLargeCount - PacketPoolReserve)
+#error IPv4MaxQueueSize has to be smaller than the packet pool without PacketPoolReserve!
+#endif
+#if (IPv4QueueDepthControl >= IPv4MaxQueueSize) || (IPv4QueueDepthInteractive >= IPv4MaxQueueSize) || (IPv4QueueDepthBulk >= IPv4MaxQueueSize)
+#error A transmit class may not fill the whole IPv4 queue!
+#endif
+uint8_t ipv4SendEvent = TASK_NO_EVENT;
+Timer ipv4RetryTimer; // Posts ipv4SendEvent after the MAC could not send
+uint8_t ipv4LoopbackEvent = TASK_NO_EVENT;
+
+// Sorted by protocol number!
+PROTOCOL_TABLE(ipv4Protocols, IPv4MaxHandlers,
+#ifndef DISABLE_ICMP
+    { ICMP, icmpProcessPacket },
+#endif
+#ifndef DISABLE_UDP
+    { UDP, udpHandlePacket },
+#endif
+);
 
 // ----------------------
 // |    Internal API    |
 // ----------------------
 
-uint8_t isBroadcastIp(uint8_t *d) {
+uint8_t isBroadcastIp(NetInterface *n, uint8_t *d) {
     uint8_t i;
     for (i = 0; i < 4; i++) {
-        if (subnetmask[i] == 255) {
-            if (!((d[i] == 255) || (d[i] == defaultGateway[i]))) {
+        if (n->subnet[i] == 255) {
+            if (!((d[i] == 255) || (d[i] == n->gateway[i]))) {
                 // ip does not match subnet or broadcast
                 return 0;
             }
@@ -82,11 +108,10 @@ uint8_t isBroadcastIp(uint8_t *d) {
 }
 
 #if (!defined(DISABLE_IPV4_CHECKSUM)) || (!defined(DISABLE_UDP_CHECKSUM))
-uint16_t checksum(uint8_t *addr, uint16_t count) {
+// Add count bytes beginning at addr to a running checksum.
+// Only the last part may have an odd length.
+uint32_t checksumAdd(uint32_t sum, uint8_t *addr, uint16_t count) {
     // C Implementation Example from RFC 1071, p. 7, slightly adapted
-    // Compute Internet Checksum for count bytes beginning at addr
-    uint32_t sum = 0;
-
     while (count > 1) {
         sum += (((uint16_t)(*addr++)) << 8);
         sum += (*addr++); // Reference Implementation assumes wrong endianness...
@@ -97,6 +122,29 @@ uint16_t checksum(uint8_t *addr, uint16_t count) {
     if (count > 0)
         sum += (((uint16_t)(*addr++)) << 8);
 
+    return sum;
+}
+
+// Add all segments of a chain. odd if an odd number of bytes was
+// added before, so the first byte is the low byte of a word.
+uint32_t checksumAddChain(uint32_t sum, PacketSegment *s, uint8_t odd) {
+    uint16_t i;
+    uint8_t b;
+    for (; s != NULL; s = s->next) {
+        for (i = 0; i < s->length; i++) {
+            b = segmentByte(s, i);
+            if (odd) {
+                sum += b;
+            } else {
+                sum += ((uint16_t)b) << 8;
+            }
+            odd = !odd;
+        }
+    }
+    return sum;
+}
+
+uint16_t checksumFold(uint32_t sum) {
     // Fold 32-bit sum to 16 bits
     while (sum >> 16) {
         sum = (sum & 0xFFFF) + (sum >> 16);
@@ -104,29 +152,176 @@ uint16_t checksum(uint8_t *addr, uint16_t count) {
 
     return ~sum;
 }
+
+uint16_t checksum(uint8_t *addr, uint16_t count) {
+    // Compute Internet Checksum for count bytes beginning at addr
+    return checksumFold(checksumAdd(0, addr, count));
+}
+
+// Update the checksum at f after the count bytes (even) at old were
+// replaced by new, without adding everything again (RFC 1624).
+uint16_t checksumUpdate(uint8_t *f, uint8_t *old, uint8_t *new, uint8_t count) {
+    uint32_t sum = (uint16_t)~get16Bit(f, 0);
+    uint8_t i;
+    for (i = 0; i < count; i += 2) {
+        sum += (uint16_t)~get16Bit(old, i);
+        sum += get16Bit(new, i);
+    }
+    sum = checksumFold(sum);
+    set16Bit(f, 0, sum);
+    return sum;
+}
 #endif
 
-uint8_t addToBuffer(Packet *p) {
-    IpElement *l = (IpElement *)mmalloc(sizeof(IpElement));
+void ipv4Retry(void) {
+    taskPost(ipv4SendEvent);
+}
+
+// Not again in every loop, the link may be down for long
+void ipv4RetryLater(void) {
+    if (ipv4RetryTimer.task == NULL) {
+        timerInit(&ipv4RetryTimer, ipv4Retry);
+    }
+    timerStart(&ipv4RetryTimer, IPv4RetryInterval, 0);
+}
+
+// The sender may still hold a reference to a queued packet, so it has
+// to stay unchanged. Give the queue its own copy before writing to it.
+// NULL if there is no buffer for it right now.
+Packet *queuedPacketWritable(IpElement *e) {
+    Packet *c;
+    if (packetShared(e->p)) {
+        if (packetAvailable() <= PacketPoolReserve) {
+            return NULL;
+        }
+        c = packetCopy(packetRetain(e->p));
+        if (c == NULL) {
+            return NULL;
+        }
+        packetRelease(e->p);
+        e->p = c;
+    }
+    return e->p;
+}
+
+// The route of a queued packet may have changed since it was queued,
+// e.g. the cable was unplugged. Move it to the new interface and
+// give it the source address of that one.
+// Returns 1 if it has to wait for a buffer to do that.
+uint8_t reroutePacket(IpElement *e) {
+    Packet *p = e->p;
+    uint8_t *h = packetL3(p);
+    NetInterface *n = netRoute(h + IPv4PacketDestinationOffset);
+#ifndef DISABLE_UDP_CHECKSUM
+    uint8_t *u;
+#endif
+
+    if ((n - netInterfaces) == p->iface) {
+        return 0;
+    }
+    if (isEqualMem(h + IPv4PacketSourceOffset, n->ip, 4)) {
+        p->iface = n - netInterfaces;
+        return 0;
+    }
+    p = queuedPacketWritable(e);
+    if (p == NULL) {
+        return 1;
+    }
+    p->iface = n - netInterfaces;
+    h = packetL3(p);
+#ifndef DISABLE_UDP_CHECKSUM
+    u = packetL4(p) + UDPChecksumOffset;
+#endif
+#ifndef DISABLE_IPV4_CHECKSUM
+    checksumUpdate(h + 10, h + IPv4PacketSourceOffset, n->ip, 4);
+#endif
+#ifndef DISABLE_UDP_CHECKSUM
+    // Source address is part of the pseudo header, 0 means no checksum
+    if ((h[IPv4PacketProtocolOffset] == UDP) && ((u[0] != 0) || (u[1] != 0))) {
+        if (checksumUpdate(u, h + IPv4PacketSourceOffset, n->ip, 4) == 0) {
+            set16Bit(u, 0, 0xFFFF);
+        }
+    }
+#endif
+    for (uint8_t i = 0; i < 4; i++) {
+        h[IPv4PacketSourceOffset + i] = n->ip[i];
+    }
+    return 0;
+}
+
+uint8_t addToBuffer(Packet *p, uint8_t c) {
+    IpElement *l, **e;
+    if ((transmissionDepth[c] >= transmissionMaxDepth[c])
+            || (packetAvailable() < PacketPoolReserve)) {
+        // Keep the slab free for the other classes, and buffers
+        // for the ARP reply we may be waiting for
+        netCount(ipv4.queueFull);
+        packetRelease(p);
+        return 1;
+    }
+    l = (IpElement *)slabAlloc(&ipv4QueueSlab);
     if (l == NULL) {
-        mfree(p->d, p->dLength);
-        mfree(p, sizeof(Packet));
+        netCount(ipv4.queueFull);
+        packetRelease(p);
         return 1;
     }
     l->p = p;
-    l->next = transmissionBuffer;
-    transmissionBuffer = l;
+    l->next = NULL;
+    for (e = &transmissionBuffer[c]; *e != NULL; e = &((*e)->next));
+    *e = l;
+    transmissionDepth[c]++;
+    taskPost(ipv4SendEvent);
     return 0;
 }
 
-IpElement *nextPacketReady(IpElement **prev) {
-    IpElement *p;
-    for (p = transmissionBuffer; p != NULL; p = p->next) {
-        if (arpGetMacFromIp(p->p->d + MACPreambleSize + IPv4PacketDestinationOffset) != NULL) {
-            return p;
+// Receive p in the next loop iteration, without the MAC.
+// p->d is the MAC header, p->iface the receiving interface.
+uint8_t loopbackPacket(Packet *p) {
+    IpElement *l, **e;
+
+    if ((p->chain != NULL) || packetShared(p)) {
+        // Receivers expect a single buffer they may modify
+        p = packetCopy(p);
+        if (p == NULL) {
+            return 1;
         }
-        if (prev != NULL) {
-            *prev = p;
+    }
+
+    l = (IpElement *)slabAlloc(&ipv4QueueSlab);
+    if (l == NULL) {
+        netCount(ipv4.queueFull);
+        packetRelease(p);
+        return 1;
+    }
+    l->p = p;
+    l->next = NULL;
+    for (e = &loopbackBuffer; *e != NULL; e = &((*e)->next));
+    *e = l;
+    taskPost(ipv4LoopbackEvent);
+    return 0;
+}
+
+// Oldest packet with known target MAC in the highest class, up to class
+// last. Strict priority, bulk data only goes out if nothing else can.
+// If link is not NULL, it gets the pointer to the packet in its list
+// and found the class of the packet.
+IpElement *nextPacketReady(IpElement ***link, uint8_t *found, uint8_t last) {
+    IpElement **e;
+    uint8_t c;
+    for (c = 0; c <= last; c++) {
+        for (e = &transmissionBuffer[c]; *e != NULL; e = &((*e)->next)) {
+            if (reroutePacket(*e)) {
+                ipv4RetryLater();
+                continue;
+            }
+            if (arpGetMacFromIp(&netInterfaces[(*e)->p->iface],
+                    packetL3((*e)->p) + IPv4PacketDestinationOffset) != NULL) {
+                if (link != NULL) {
+                    *link = e;
+                    *found = c;
+                }
+                return *e;
+            }
         }
     }
     return NULL;
@@ -136,12 +331,12 @@ IpElement *nextPacketReady(IpElement **prev) {
 // |    External API    |
 // ----------------------
 
-void ipv4Init(IPv4Address ip, IPv4Address subnet, IPv4Address gateway) {
+void ipv4Init(NetInterface *n, IPv4Address ip, IPv4Address subnet, IPv4Address gateway) {
     uint8_t i;
     for (i = 0; i < 4; i++) {
-        ownIpAddress[i] = ip[i];
-        subnetmask[i] = subnet[i];
-        defaultGateway[i] = gateway[i];
+        n->ip[i] = ip[i];
+        n->subnet[i] = subnet[i];
+        n->gateway[i] = gateway[i];
     }
 #if DEBUG >= 3
     debugPrint("IP: ");
@@ -177,61 +372,82 @@ uint8_t ipv4LastProtocol(void) {
 
 // Returns 0 on success, 1 if not enough mem, 2 if packet invalid.
 uint8_t ipv4ProcessPacket(Packet *p) {
-    uint16_t cs = 0x0000, w;
-    uint8_t pr;
+    uint16_t cs = 0x0000, w, length;
+    uint8_t pr, headerLength;
+    uint8_t *h = packetL3(p);
+    PacketHandler handler;
 #if DEBUG >= 2
     uint8_t i;
 #endif
 
-    assert(p->dLength > (MACPreambleSize + IPv4PacketHeaderLength)); // Big enough
     assert(p->dLength < MaxPacketSize); // Not too big
+    netCount(ipv4.rx);
+
+    // Header length can include options, total length excludes padding
+    if (packetEnd(p) < (h + IPv4PacketHeaderLength)) {
+        debugPrint("IPv4 Packet too short!\n");
+        netCount(ipv4.invalid);
+        packetRelease(p);
+        return 2;
+    }
+    headerLength = (h[0] & 0x0F) * 4;
+    length = get16Bit(h, IPv4PacketLengthOffset);
+    if ((headerLength < IPv4PacketHeaderLength) || (length < headerLength)
+            || (packetEnd(p) < (h + length))) {
+        debugPrint("IPv4 Packet too short!\n");
+        netCount(ipv4.invalid);
+        packetRelease(p);
+        return 2;
+    }
+    p->dLength = (h + length) - p->d; // Strip Ethernet padding and CRC
+    p->l4 = p->l3 + headerLength;
 
 #ifndef DISABLE_IPV4_CHECKSUM
-    cs = checksum(p->d + MACPreambleSize, IPv4PacketHeaderLength);
+    cs = checksum(h, headerLength);
 #endif
-    if ((cs != 0x0000) || ((p->d[MACPreambleSize] & 0xF0) != 0x40)) {
+    if ((cs != 0x0000) || ((h[0] & 0xF0) != 0x40)) {
         // Checksum or version invalid
 #if DEBUG >= 1
         debugPrint("Checksum: ");
         debugPrint(hexToString(cs));
         debugPrint("  First byte: ");
-        debugPrint(hexToString(p->d[MACPreambleSize]));
+        debugPrint(hexToString(h[0]));
         debugPrint("!\n");
 #endif
-        mfree(p->d, p->dLength);
-        mfree(p, sizeof(Packet));
+        netCount(ipv4.checksum);
+        packetRelease(p);
         return 2;
     } else {
         debugPrint("Valid IPv4 Packet!\n");
     }
 
-    w = get16Bit(p->d, MACPreambleSize + IPv4PacketFlagsOffset);
+    w = get16Bit(h, IPv4PacketFlagsOffset);
     if (w & 0x1FFF) {
 #if DEBUG >= 1
         debugPrint("Fragment Offset is ");
         debugPrint(hexToString(w & 0x1FFF));
         debugPrint("!\n");
 #endif
-        mfree(p->d, p->dLength);
-        mfree(p, sizeof(Packet));
+        netCount(ipv4.fragment);
+        packetRelease(p);
         return 2;
     }
     if (w & 0x2000) {
         // Part of a fragmented IPv4 Packet... No support for that
         debugPrint("More Fragments follow!\n");
-        mfree(p->d, p->dLength);
-        mfree(p, sizeof(Packet));
+        netCount(ipv4.fragment);
+        packetRelease(p);
         return 2;
     }
 
-    if (isBroadcastIp(p->d + MACPreambleSize + IPv4PacketDestinationOffset)) {
+    if (isBroadcastIp(&netInterfaces[p->iface], h + IPv4PacketDestinationOffset)) {
         debugPrint("IPv4 Broadcast Packet!\n");
-    } else if (isEqualMem(ownIpAddress, p->d + MACPreambleSize + IPv4PacketDestinationOffset, 4)) {
+    } else if (isEqualMem(netInterfaces[p->iface].ip, h + IPv4PacketDestinationOffset, 4)) {
         debugPrint("IPv4 Packet for us!\n");
     } else {
         debugPrint("IPv4 Packet not for us!\n");
-        mfree(p->d, p->dLength);
-        mfree(p, sizeof(Packet));
+        netCount(ipv4.notForUs);
+        packetRelease(p);
         return 0;
     }
 
@@ -239,14 +455,14 @@ uint8_t ipv4ProcessPacket(Packet *p) {
 #if DEBUG >= 2
     debugPrint("From: ");
     for (i = 0; i < 4; i++) {
-        debugPrint(timeToString(p->d[MACPreambleSize + IPv4PacketSourceOffset + i]));
+        debugPrint(timeToString(h[IPv4PacketSourceOffset + i]));
         if (i < 3) {
             debugPrint(".");
         }
     }
     debugPrint("\nTo: ");
     for (i = 0; i < 4; i++) {
-        debugPrint(timeToString(p->d[MACPreambleSize + IPv4PacketDestinationOffset + i]));
+        debugPrint(timeToString(h[IPv4PacketDestinationOffset + i]));
         if (i < 3) {
             debugPrint(".");
         }
@@ -254,72 +470,92 @@ uint8_t ipv4ProcessPacket(Packet *p) {
     debugPrint("\n");
 #endif
 
-    pr = p->d[MACPreambleSize + IPv4PacketProtocolOffset];
+    pr = h[IPv4PacketProtocolOffset];
     ipLastProtocol = pr;
-    if (pr == ICMP) {
-        debugPrint("Is ICMP Packet!\n");
-        return icmpProcessPacket(p);
-    } else if (pr == IGMP) {
-        debugPrint("Is IGMP Packet!\n");
-    } else if (pr == TCP) {
-        debugPrint("Is TCP Packet!\n");
-    } else if (pr == UDP) {
-        debugPrint("Is UDP Packet!\n");
-        return udpHandlePacket(p);
-    } else {
-#if DEBUG >= 1
-        debugPrint("No handler for: ");
-        debugPrint(hexToString(pr));
-        debugPrint("!\n");
-#endif
-        mfree(p->d, p->dLength);
-        mfree(p, sizeof(Packet));
-        return 0;
+    handler = protocolFind(&ipv4Protocols, pr);
+    if (handler != NULL) {
+        return handler(p);
     }
 
-    mfree(p->d, p->dLength);
-    mfree(p, sizeof(Packet));
+#if DEBUG >= 1
+    debugPrint("No handler for: ");
+    debugPrint(hexToString(pr));
+    debugPrint("!\n");
+#endif
+    netCount(ipv4.noHandler);
+    packetRelease(p);
     return 0;
 }
 
-uint8_t ipv4SendPacket(Packet *p, uint8_t *target, uint8_t protocol) {
-    uint16_t tLength = p->dLength - MACPreambleSize;
-    uint8_t *mac = NULL;
+uint8_t ipv4RegisterHandler(uint8_t protocol, PacketHandler handler) {
+    return protocolRegister(&ipv4Protocols, protocol, handler);
+}
+
+uint8_t ipv4SendPacket(Packet *p, uint8_t *target, uint8_t protocol, uint8_t tos, uint8_t txClass) {
+    uint16_t tLength;
+    uint8_t i, *h, *mac = NULL;
+    NetInterface *n = netRoute(target);
 
     // Prepare Header Data
-    p->d[12] = (IPV4 & 0xFF00) >> 8;
-    p->d[13] = (IPV4 & 0x00FF); // IPv4 Protocol
-    p->d[MACPreambleSize + 0] = (4) << 4; // Version
-    p->d[MACPreambleSize + 0] |= 5; // InternetHeaderLength
-    p->d[MACPreambleSize + 1] = 0; // Type Of Service
-    p->d[MACPreambleSize + 2] = (tLength & 0xFF00) >> 8;
-    p->d[MACPreambleSize + 3] = (tLength & 0x00FF);
-    p->d[MACPreambleSize + 4] = (risingIdentification & 0xFF00) >> 8;
-    p->d[MACPreambleSize + 5] = (risingIdentification++ & 0x00FF);
-    p->d[MACPreambleSize + 6] = 0;
-    p->d[MACPreambleSize + 7] = 0; // Flags and Fragment Offset
-    p->d[MACPreambleSize + 8] = 0xFF; // Time To Live
-    p->d[MACPreambleSize + 10] = 0;
-    p->d[MACPreambleSize + 11] = 0; // Checksum field
-    p->d[MACPreambleSize + IPv4PacketProtocolOffset] = protocol;
+    p->l4 = packetHeadroom(p);
+    h = packetPush(p, IPv4PacketHeaderLength);
+    p->l3 = packetHeadroom(p);
+    p->iface = n - netInterfaces;
+    tLength = packetLength(p);
+    h[0] = (4) << 4; // Version
+    h[0] |= 5; // InternetHeaderLength
+    h[IPv4PacketTosOffset] = tos;
+    h[2] = (tLength & 0xFF00) >> 8;
+    h[3] = (tLength & 0x00FF);
+    h[4] = (risingIdentification & 0xFF00) >> 8;
+    h[5] = (risingIdentification++ & 0x00FF);
+    h[6] = 0;
+    h[7] = 0; // Flags and Fragment Offset
+    h[8] = 0xFF; // Time To Live
+    h[10] = 0;
+    h[11] = 0; // Checksum field
+    h[IPv4PacketProtocolOffset] = protocol;
     for (tLength = 0; tLength < 4; tLength++) {
-        p->d[MACPreambleSize + IPv4PacketSourceOffset + tLength] = ownIpAddress[tLength];
-        p->d[MACPreambleSize + IPv4PacketDestinationOffset + tLength] = target[tLength];
+        h[IPv4PacketSourceOffset + tLength] = n->ip[tLength];
+        h[IPv4PacketDestinationOffset + tLength] = target[tLength];
     }
 
 #ifndef DISABLE_IPV4_CHECKSUM
-    tLength = checksum(p->d + MACPreambleSize, IPv4PacketHeaderLength);
-    p->d[MACPreambleSize + 10] = (tLength & 0xFF00) >> 8;
-    p->d[MACPreambleSize + 11] = (tLength & 0x00FF);
+    tLength = checksum(h, IPv4PacketHeaderLength);
+    h[10] = (tLength & 0xFF00) >> 8;
+    h[11] = (tLength & 0x00FF);
 #endif
 
+    packetPush(p, MACPreambleSize);
+    p->d[MACTypeOffset] = (IPV4 & 0xFF00) >> 8;
+    p->d[MACTypeOffset + 1] = (IPV4 & 0x00FF); // IPv4 Protocol
+
+    netCount(ipv4.tx);
+
+    for (i = 0; i < netInterfaceCount; i++) {
+        if (isEqualMem(target, netInterfaces[i].ip, 4)) {
+            // To ourselves, received by the interface with this address
+            p->iface = i;
+            for (tLength = 0; tLength < 6; tLength++) {
+                p->d[tLength] = netInterfaces[i].mac[tLength];
+                p->d[6 + tLength] = netInterfaces[i].mac[tLength];
+            }
+            return loopbackPacket(p);
+        }
+    }
+
+    if (nextPacketReady(NULL, NULL, txClass) != NULL) {
+        // Don't overtake queued packets of this or a higher class
+        return addToBuffer(p, txClass);
+    }
+
     // Aquire MAC
-    mac = arpGetMacFromIp(target);
+    mac = arpGetMacFromIp(n, target);
     if (mac != NULL) { // Target MAC known
         // Insert MACs
         for (tLength = 0; tLength < 6; tLength++) {
             p->d[tLength] = mac[tLength]; // Destination
-            p->d[6 + tLength] = ownMacAddress[tLength]; // Source
+            p->d[6 + tLength] = n->mac[tLength]; // Source
         }
 
         // Try to send packet...
@@ -329,48 +565,100 @@ uint8_t ipv4SendPacket(Packet *p, uint8_t *target, uint8_t protocol) {
             debugPrint("Moved Packet into IPv4 Transmit Buffer (");
             debugPrint(timeToString(tLength));
             debugPrint(")\n");
-            return addToBuffer(p);
+            return addToBuffer(p, txClass);
         }
-        mfree(p->d, p->dLength);
-        mfree(p, sizeof(Packet));
+        packetRelease(p);
         return 0;
     } else {
         // MAC Unknown, insert packet into queue
         debugPrint("MAC Unknown. Moved Packet into IPv4 Transmit Buffer.\n");
-        return addToBuffer(p);
+        netCount(ipv4.unresolved);
+        return addToBuffer(p, txClass);
     }
 }
 
 void ipv4SendQueue(void) {
     uint8_t *mac;
-    IpElement *prev;
-    IpElement *p = nextPacketReady(&prev);
+    IpElement **e;
+    uint8_t c;
+    IpElement *p = nextPacketReady(&e, &c, IPV4_CLASS_BULK);
+    NetInterface *n;
+    // If nothing is ready, ARP posts ipv4SendEvent when that changes
     if (p != NULL) {
         debugPrint("Working on IPv4 Send Queue...\n");
-        mac = arpGetMacFromIp(p->p->d + MACPreambleSize + IPv4PacketDestinationOffset);
+        if (queuedPacketWritable(p) == NULL) {
+            ipv4RetryLater();
+            return;
+        }
+        n = &netInterfaces[p->p->iface];
+        mac = arpGetMacFromIp(n, packetL3(p->p) + IPv4PacketDestinationOffset);
         for (uint8_t i = 0; i < 6; i++) {
             p->p->d[i] = mac[i]; // Destination
-            p->p->d[6 + i] = ownMacAddress[i]; // Source
+            p->p->d[6 + i] = n->mac[i]; // Source
         }
-        p->p->d[12] = (IPV4 & 0xFF00) >> 8;
-        p->p->d[13] = (IPV4 & 0x00FF); // IPv4 Protocol
 
         // Try to send packet...
-        if (macSendPacket(p->p) == 0) {
-            if (prev == NULL) {
-                transmissionBuffer = p->next;
+        if (macSendPacket(p->p) != 0) {
+            ipv4RetryLater();
+            return;
+        }
+        *e = p->next;
+        transmissionDepth[c]--;
+        packetRelease(p->p);
+        slabFree(&ipv4QueueSlab, p);
+        if (ipv4PacketsInQueue() != 0) {
+            taskPost(ipv4SendEvent); // Send the next one
+        }
+    }
+}
+
+void ipv4LoopbackQueue(void) {
+    IpElement *l = loopbackBuffer;
+    Packet *p;
+    if (l != NULL) {
+        loopbackBuffer = l->next;
+        p = l->p;
+        slabFree(&ipv4QueueSlab, l); // Free for an answer
+        p->time = getSystemTimeUs();
+        ipv4ProcessPacket(p);
+        if (loopbackBuffer != NULL) {
+            taskPost(ipv4LoopbackEvent); // One per loop iteration
+        }
+    }
+}
+
+void ipv4DropUnresolved(uint8_t iface, IPv4Address ip) {
+    IpElement **e, *l;
+    NetInterface *n;
+    uint8_t c, *d;
+    for (c = 0; c < IPV4_CLASSES; c++) {
+        e = &transmissionBuffer[c];
+        while (*e != NULL) {
+            if ((*e)->p->iface != iface) {
+                e = &((*e)->next);
+                continue;
+            }
+            n = &netInterfaces[iface];
+            d = packetL3((*e)->p) + IPv4PacketDestinationOffset;
+            if (!isIpInThisNetwork(n, d)) {
+                d = n->gateway; // Resolved like arpGetMacFromIp() does
+            }
+            if (isEqualMem(d, ip, 4)) {
+                l = *e;
+                *e = l->next;
+                transmissionDepth[c]--;
+                netCount(ipv4.unreachable);
+                packetRelease(l->p);
+                slabFree(&ipv4QueueSlab, l);
             } else {
-                prev->next = p->next;
+                e = &((*e)->next);
             }
-            mfree(p->p->d, p->p->dLength);
-            mfree(p->p, sizeof(Packet));
-            mfree(p, sizeof(IpElement));
         }
     }
 }
 
 uint8_t ipv4PacketsToSend(void) {
-    if (nextPacketReady(NULL) != NULL) {
+    if (nextPacketReady(NULL, NULL, IPV4_CLASS_BULK) != NULL) {
         return 1;
     } else {
         return 0;
@@ -379,8 +667,8 @@ uint8_t ipv4PacketsToSend(void) {
 
 uint8_t ipv4PacketsInQueue(void) {
     uint8_t c = 0;
-    for (IpElement *p = transmissionBuffer; p != NULL; p = p->next) {
-        c++;
+    for (uint8_t i = 0; i < IPV4_CLASSES; i++) {
+        c += transmissionDepth[i];
     }
     return c;
 }
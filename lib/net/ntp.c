@@ -46,6 +46,9 @@
 
 #define NTPMessageSize 48
 #define NTPFirstByte 0x0B // Version 1, Mode 3 (Client)
+#define NTPOriginateOffset 24
+#define NTPReceiveOffset 32
+#define NTPTransmitOffset 40
 
 #ifndef DISABLE_DNS
 uint8_t ntpServerDomain[] = "0.de.pool.ntp.org";
@@ -53,17 +56,82 @@ uint8_t ntpServerDomain[] = "0.de.pool.ntp.org";
 
 IPv4Address ntpServer = { 78, 46, 85, 230 };
 
+uint32_t ntpRequestTime; // getSystemTimeUs() when the request was sent
+tick_t ntpLastSample; // getSystemTime() of the last offset sample
+uint8_t ntpHasSample = 0;
+
+uint32_t ntpGet32(uint8_t *d) {
+    return ((uint32_t)d[0] << 24) | ((uint32_t)d[1] << 16)
+        | ((uint32_t)d[2] << 8) | d[3];
+}
+
+// NTP Timestamp (seconds and fraction) to UNIX time in ms
+time_t ntpToUnixMs(uint8_t *d) {
+    time_t t = ntpGet32(d) - 2208988800;
+    t *= 1000;
+    t += ((time_t)ntpGet32(d + 4) * 1000) >> 32;
+    return t;
+}
+
+void ntpDiscipline(int32_t offset) {
+    tick_t interval = diffTime(getSystemTime(), ntpLastSample);
+    int32_t drift, f;
+
+    if (ntpHasSample && (interval < NTPMinInterval)) {
+        // Too short to learn anything about our frequency
+        timeAdjust(offset);
+        return;
+    }
+
+    if (ntpHasSample) {
+        // The part of the offset that is not explained by the last,
+        // unfinished slew was caused by our frequency error.
+        drift = offset - timeAdjustRemaining();
+        f = timeGetFrequency() + (((int64_t)drift * 1000000000) / interval) / 2;
+        if (f > NTPMaxFrequency) {
+            f = NTPMaxFrequency;
+        } else if (f < -NTPMaxFrequency) {
+            f = -NTPMaxFrequency;
+        }
+        timeSetFrequency(f);
+    }
+    timeAdjust(offset);
+    ntpLastSample = getSystemTime();
+    ntpHasSample = 1;
+}
+
 uint8_t ntpHandler(Packet *p) {
-    time_t stamp = 0;
+    uint8_t *d = packetL4(p) + UDPDataOffset;
+    uint32_t rtt = p->time - ntpRequestTime; // us
+    time_t local, server;
+    int64_t offset;
+
     debugPrint("Got NTP Response!\n");
-    stamp |= (time_t)p->d[UDPOffset + UDPDataOffset + 16] << 24;
-    stamp |= (time_t)p->d[UDPOffset + UDPDataOffset + 17] << 16;
-    stamp |= (time_t)p->d[UDPOffset + UDPDataOffset + 18] << 8;
-    stamp |= (time_t)p->d[UDPOffset + UDPDataOffset + 19];
-    setNtpTimestamp(stamp);
-    mfree(p->d, p->dLength);
-    mfree(p, sizeof(Packet));
-    debugPrint("Injected new timestamp!\n");
+
+    // The server copies our transmit timestamp to originate
+    if ((packetL4Length(p) < (UDPDataOffset + NTPMessageSize))
+            || (ntpGet32(d + NTPOriginateOffset + 4) != ntpRequestTime)) {
+        debugPrint("NTP Response invalid!\n");
+        packetRelease(p);
+        return 2;
+    }
+
+    // Compare the server time with our time in the middle of the exchange
+    server = ntpToUnixMs(d + NTPReceiveOffset) / 2;
+    server += ntpToUnixMs(d + NTPTransmitOffset) / 2;
+    local = getUnixTimeMs() - ((getSystemTimeUs() - p->time) + (rtt / 2)) / 1000;
+    offset = (int64_t)(server - local);
+    packetRelease(p);
+
+    if ((!unixTimeIsSet()) || (offset > NTPStepThreshold)) {
+        // First sync, or we are far behind. Jumping forward is allowed.
+        setTimestampMs(getUnixTimeMs() + offset);
+        timeAdjust(0);
+        debugPrint("Injected new timestamp!\n");
+    } else if (rtt <= (NTPMaxRoundTrip * 1000L)) {
+        ntpDiscipline(offset);
+        debugPrint("Adjusting time!\n");
+    }
     return 0;
 }
 
@@ -74,29 +142,29 @@ uint8_t ntpHandler(Packet *p) {
 // 0 on success, 1 on no mem, 2 on error
 uint8_t ntpIssueRequest(void) {
     uint8_t i;
-    Packet *p = (Packet *)mmalloc(sizeof(Packet));
+    Packet *p = udpAllocPacket(NTPMessageSize);
     if (p == NULL) {
         return 1;
     }
-    p->dLength = UDPOffset + UDPDataOffset + NTPMessageSize;
-    p->d = (uint8_t *)mmalloc(p->dLength);
-    if (p->d == NULL) {
-        mfree(p, sizeof(Packet));
-        return 1;
-    }
 
 #ifndef DISABLE_DNS
     dnsGetIp(ntpServerDomain, ntpServer); // If it doesn't work, we rely on the defaults
 #endif
 
-    p->d[UDPOffset + UDPDataOffset] = NTPFirstByte;
+    p->d[0] = NTPFirstByte;
     for (i = 1; i < NTPMessageSize; i++) {
-        p->d[UDPOffset + UDPDataOffset + i] = 0x00; // Yes, SNTP is simple...
+        p->d[i] = 0x00; // Yes, SNTP is simple...
+    }
+
+    // Our transmit timestamp is only used to recognize the response
+    ntpRequestTime = getSystemTimeUs();
+    for (i = 0; i < 4; i++) {
+        p->d[NTPTransmitOffset + 4 + i] = (ntpRequestTime >> (24 - (8 * i))) & 0xFF;
     }
 
     debugPrint("Sending NTP Request...\n");
 
-    return udpSendPacket(p, ntpServer, 123, 123);
+    return udpSendPacketClass(p, ntpServer, 123, 123, IPV4_CLASS_INTERACTIVE); // Timestamps age in the queue
 }
 
 #endif // DISABLE_NTP
@@ -0,0 +1,220 @@
+/*
+ * packet.c
+ *
+ * Copyright (c) 2012, Thomas Buck <xythobuz@me.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <avr/io.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <avr/pgmspace.h>
+#include <avr/eeprom.h>
+
+#define DEBUG 0
+
+#include <net/packet.h>
+#include <net/controller.h>
+
+#define BUFFER(size) (sizeof(Packet) + (size))
+#define CLASSBYTES(x) (PacketPool##x##Count * BUFFER(PacketPool##x##Size))
+
+uint8_t packetMemory[CLASSBYTES(Small) + CLASSBYTES(Medium) + CLASSBYTES(Large)];
+
+PacketPool packetPools[PACKETPOOLS] = {
+    { NULL, PacketPoolSmallSize, PacketPoolSmallCount, 0, 0, 0 },
+    { NULL, PacketPoolMediumSize, PacketPoolMediumCount, 0, 0, 0 },
+    { NULL, PacketPoolLargeSize, PacketPoolLargeCount, 0, 0, 0 }
+};
+uint16_t packetTooBig = 0;
+
+// ----------------------
+// |    External API    |
+// ----------------------
+
+void packetInit(void) {
+    uint8_t i, j;
+    uint8_t *m = packetMemory;
+    Packet *p;
+
+    for (i = 0; i < PACKETPOOLS; i++) {
+        packetPools[i].free = NULL;
+        for (j = 0; j < packetPools[i].count; j++) {
+            p = (Packet *)m;
+            p->pool = i;
+            p->refs = 0;
+            p->d = (uint8_t *)packetPools[i].free;
+            packetPools[i].free = p;
+            m += BUFFER(packetPools[i].size);
+        }
+        packetPools[i].available = packetPools[i].count;
+        packetPools[i].minAvailable = packetPools[i].count;
+    }
+}
+
+Packet *packetAlloc(uint16_t length) {
+    return packetAllocHeadroom(0, length);
+}
+
+Packet *packetAllocHeadroom(uint16_t headroom, uint16_t length) {
+    uint8_t i, first = PACKETPOOLS;
+    PacketPool *c;
+    Packet *p;
+
+    for (i = 0; i < PACKETPOOLS; i++) {
+        c = &packetPools[i];
+        if (((headroom + length) > c->size) || (c->count == 0)) {
+            continue;
+        }
+        if (first == PACKETPOOLS) {
+            first = i;
+        }
+        if (c->free != NULL) {
+            p = c->free;
+            c->free = (Packet *)p->d;
+            if (--c->available < c->minAvailable) {
+                c->minAvailable = c->available;
+            }
+            p->d = packetBuffer(p) + headroom;
+            p->dLength = length;
+            p->chain = NULL;
+            p->l3 = headroom;
+            p->l4 = headroom;
+            p->time = 0;
+            p->refs = 1;
+            p->iface = 0;
+            return p;
+        }
+    }
+
+    if (first == PACKETPOOLS) {
+        packetTooBig++;
+    } else {
+        packetPools[first].exhausted++;
+    }
+    debugPrint("No packet buffer left!\n");
+    return NULL;
+}
+
+Packet *packetRetain(Packet *p) {
+    assert(p->refs > 0); // Already freed?
+    assert(p->refs < 0xFF);
+    p->refs++;
+    return p;
+}
+
+void packetRelease(Packet *p) {
+    PacketPool *c;
+    assert(p->pool < PACKETPOOLS);
+    assert(p->refs > 0); // Already freed?
+    if (--p->refs > 0) {
+        return; // Still used somewhere else
+    }
+    c = &packetPools[p->pool];
+    p->d = (uint8_t *)c->free;
+    c->free = p;
+    c->available++;
+}
+
+uint8_t packetAvailable(void) {
+    uint8_t i, n = 0;
+    for (i = 0; i < PACKETPOOLS; i++) {
+        n += packetPools[i].available;
+    }
+    return n;
+}
+
+uint16_t packetExhausted(void) {
+    uint16_t n = 0;
+    for (uint8_t i = 0; i < PACKETPOOLS; i++) {
+        n += packetPools[i].exhausted;
+    }
+    return n;
+}
+
+uint8_t *packetPush(Packet *p, uint16_t n) {
+    assert(packetHeadroom(p) >= n);
+    p->d -= n;
+    p->dLength += n;
+    return p->d;
+}
+
+uint8_t *packetPull(Packet *p, uint16_t n) {
+    assert(p->dLength >= n);
+    p->d += n;
+    p->dLength -= n;
+    return p->d;
+}
+
+void packetAppend(Packet *p, PacketSegment *s) {
+    PacketSegment **l = &p->chain;
+    while (*l != NULL) {
+        l = &(*l)->next;
+    }
+    s->next = NULL;
+    *l = s;
+}
+
+Packet *packetCopy(Packet *p) {
+    PacketSegment *s;
+    Packet *c;
+    uint16_t i, j;
+
+    c = packetAlloc(packetLength(p));
+    if (c != NULL) {
+        for (i = 0; i < p->dLength; i++) {
+            c->d[i] = p->d[i];
+        }
+        for (s = p->chain; s != NULL; s = s->next) {
+            for (j = 0; j < s->length; j++) {
+                c->d[i++] = segmentByte(s, j);
+            }
+        }
+        c->l3 = packetHeadroom(c) + (p->l3 - packetHeadroom(p));
+        c->l4 = packetHeadroom(c) + (p->l4 - packetHeadroom(p));
+        c->iface = p->iface;
+        c->time = p->time;
+    }
+    packetRelease(p);
+    return c;
+}
+
+uint16_t packetLength(Packet *p) {
+    uint16_t l = p->dLength;
+    for (PacketSegment *s = p->chain; s != NULL; s = s->next) {
+        l += s->length;
+    }
+    return l;
+}
+
+uint8_t segmentByte(PacketSegment *s, uint16_t i) {
+    if (s->memory == SEGMENT_FLASH) {
+        return pgm_read_byte(s->d + i);
+    } else if (s->memory == SEGMENT_EEPROM) {
+        return eeprom_read_byte(s->d + i);
+    } else {
+        return s->d[i];
+    }
+}
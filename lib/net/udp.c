@@ -34,22 +34,25 @@
 #define DEBUG 0
 
 #include <std.h>
+#include <slab.h>
 #include <net/icmp.h>
 #include <net/utils.h>
 #include <net/udp.h>
+#include <net/stats.h>
 #include <net/utils.h>
 #include <net/controller.h>
 
 #ifndef DISABLE_UDP
 
-uint8_t isBroadcastIp(uint8_t *d);
-
-typedef struct {
+typedef struct UdpHandler UdpHandler;
+struct UdpHandler {
     uint16_t port;
     uint8_t (*func)(Packet *);
-} UdpHandler;
+    UdpHandler *next;
+};
 
-UdpHandler *handlers = NULL;
+UdpHandler *handlers = NULL; // Single-linked-list
+SLAB(udpHandlerSlab, UdpHandler, UDPMaxHandlers);
 uint16_t udpRegisteredHandlers = 0;
 IPv4Address target;
 
@@ -57,81 +60,42 @@ IPv4Address target;
 // |      Internal API      |
 // --------------------------
 
-uint16_t checksum(uint8_t *rawData, uint16_t l); // From ipv4.c
+uint32_t checksumAdd(uint32_t sum, uint8_t *addr, uint16_t count); // From ipv4.c
+uint32_t checksumAddChain(uint32_t sum, PacketSegment *s, uint8_t odd); // From ipv4.c
+uint16_t checksumFold(uint32_t sum); // From ipv4.c
 
-int16_t findHandler(uint16_t port) {
-    uint16_t i;
-    if (handlers != NULL) {
-        for (i = 0; i < udpRegisteredHandlers; i++) {
-            if (handlers[i].port == port) {
-                return i;
-            }
+// First handler for port after h, or from the start if h is NULL
+UdpHandler *findHandler(UdpHandler *h, uint16_t port) {
+    for (h = (h == NULL) ? handlers : h->next; h != NULL; h = h->next) {
+        if (h->port == port) {
+            return h;
         }
     }
-    return -1;
+    return NULL;
 }
 
 #ifndef DISABLE_UDP_CHECKSUM
-uint16_t udpChecksum(Packet *p) {
-    uint8_t i;
-    uint16_t cs;
-    // We create the pseudo header in our already present buffer,
-    // calculate the checksum,
-    // then move the ip addresses back to their old places, so it can be used again...
-    // Required: UDP Length, Source and Target IP, UDP Data
-
-    // Move IPs (8 bytes) from IPv4PacketSourceOffset (12) to 8
-    for (i = 0; i < 8; i++) {
-        p->d[MACPreambleSize + 8 + i] = p->d[MACPreambleSize + IPv4PacketSourceOffset + i];
-    }
-
-    // Insert data for Pseudo Header
-    p->d[MACPreambleSize + 16] = 0x00; // Zeros
-    p->d[MACPreambleSize + 17] = 0x11; // UDP Protocol
-    p->d[MACPreambleSize + 18] = p->d[UDPOffset + UDPLengthOffset];
-    p->d[MACPreambleSize + 19] = p->d[UDPOffset + UDPLengthOffset + 1]; // UDP Length
-
-    // Clear UDP Checksum field
-    p->d[UDPOffset + UDPChecksumOffset] = 0;
-    p->d[UDPOffset + UDPChecksumOffset + 1] = 0;
+// With a zeroed checksum field this returns the value for it, over a
+// received datagram the result is 0 if it was correct. The pseudo
+// header is summed up separately, so the IPv4 header is not touched.
+uint16_t udpChecksum(Packet *p, uint8_t *source, uint8_t *destination) {
+    uint16_t length = get16Bit(packetL4(p), UDPLengthOffset);
+    uint16_t buffered = (p->chain == NULL) ? length : packetL4Length(p);
+    uint32_t sum;
 
 #if DEBUG >= 2
     debugPrint("\nChecksum data size: ");
-    debugPrint(timeToString(12 + get16Bit(p->d, UDPOffset + UDPLengthOffset)));
-    debugPrint(" bytes.\nPseudo Header: ");
-    for (i = 0; i < 12; i++) {
-        if (i < 8) {
-            debugPrint(timeToString((p->d + MACPreambleSize + 8)[i]));
-        } else {
-            debugPrint(hex2ToString((p->d + MACPreambleSize + 8)[i]));
-        }
-        if (i < 11) {
-            debugPrint(" ");
-        }
-    }
-    debugPrint("\nUDP Header: ");
-    for (i = 0; i < 8; i++) {
-        debugPrint(hex2ToString((p->d + MACPreambleSize + 20)[i]));
-        if (i < 7) {
-            debugPrint(" ");
-        }
-    }
-    debugPrint("\n\n");
+    debugPrint(timeToString(12 + length));
+    debugPrint(" bytes.\n");
 #endif
 
-    // Calculate Checksum
-    cs = checksum(p->d + MACPreambleSize + 8, 12 + get16Bit(p->d, UDPOffset + UDPLengthOffset));
-
-    // Move IPs back
-    for (i = 0; i < 8; i++) {
-        p->d[MACPreambleSize + 12 + i] = p->d[MACPreambleSize + 8 + i];
-    }
-    // Restore IPv4 Protocol and Checksum
-    p->d[MACPreambleSize + IPv4PacketProtocolOffset] = 0x11; // UDP
-    p->d[MACPreambleSize + IPv4PacketProtocolOffset + 1] = 0;
-    p->d[MACPreambleSize + IPv4PacketProtocolOffset + 2] = 0; // Checksum field
-
-    return cs;
+    sum = checksumAdd(0, source, 4);
+    sum = checksumAdd(sum, destination, 4);
+    sum += UDP; // Zeros and Protocol
+    sum += length;
+    sum = checksumAdd(sum, packetL4(p), buffered);
+    sum = checksumAddChain(sum, p->chain, buffered & 1);
+    return checksumFold(sum);
 }
 #endif
 
@@ -143,90 +107,109 @@ void udpInit(void) {}
 
 // 0 on success, 1 not enough mem, 2 invalid
 uint8_t udpHandlePacket(Packet *p) {
-    uint8_t i;
-    uint16_t ocs = 0x0000, cs = 0x0000;
+    UdpHandler *h;
+    uint16_t cs = 0x0000, port, length;
+    uint8_t r = 0;
 
-    assert(p->dLength > (UDPOffset + UDPDataOffset));
     assert(p->dLength < MaxPacketSize);
+    netCount(udp.rx);
+
+    length = get16Bit(packetL4(p), UDPLengthOffset);
+    if ((packetL4Length(p) < UDPDataOffset) || (length < UDPDataOffset)
+            || (length > packetL4Length(p))) {
+        debugPrint("UDP Length invalid!\n");
+        netCount(udp.invalid);
+        packetRelease(p);
+        return 2;
+    }
+
+    // Nobody listens? Then don't waste time on the checksum
+    port = get16Bit(packetL4(p), UDPDestinationOffset);
+    h = findHandler(NULL, port);
+    if (h == NULL) {
+        debugPrint("UDP: No handler for ");
+        debugPrint(timeToString(port));
+        debugPrint("\n");
+        netCount(udp.noHandler);
+        packetRelease(p);
+        return 0;
+    }
 
 #ifndef DISABLE_UDP_CHECKSUM
-    ocs = get16Bit(p->d, UDPOffset + UDPChecksumOffset);
-    cs = udpChecksum(p);
+    if (get16Bit(packetL4(p), UDPChecksumOffset) != 0x0000) { // 0: not used
+        cs = udpChecksum(p, packetL3(p) + IPv4PacketSourceOffset,
+                packetL3(p) + IPv4PacketDestinationOffset);
+    }
 #endif
-    if (cs != ocs) {
+    if (cs != 0x0000) {
 #if DEBUG >= 1
         debugPrint("UDP Checksum invalid: ");
         debugPrint(hexToString(cs));
-        debugPrint(" != ");
-        debugPrint(hexToString(ocs));
         debugPrint("\n");
 #endif
-        mfree(p->d, p->dLength);
-        mfree(p, sizeof(Packet));
+        netCount(udp.checksum);
+        packetRelease(p);
         return 2;
     }
 
-    // Look for a handler
-    for (i = 0; i < udpRegisteredHandlers; i++) {
-        if (handlers[i].port == get16Bit(p->d, UDPOffset + UDPDestinationOffset)) {
-            // found handler
-            return handlers[i].func(p);
+    // Every handler for this port gets its own reference
+    while (h != NULL) {
+        if (h->func(packetRetain(p)) != 0) {
+            r = 1;
         }
+        h = findHandler(h, port);
     }
-
-    debugPrint("UDP: No handler for ");
-    debugPrint(timeToString(get16Bit(p->d, UDPOffset + UDPDestinationOffset)));
-    debugPrint("\n");
-    mfree(p->d, p->dLength);
-    mfree(p, sizeof(Packet));
-    return 0;
+    packetRelease(p);
+    return r;
 }
 
 
-// Overwrites existing handler for this port
+// More than one handler can listen on the same port
 // 0 on succes, 1 on not enough RAM
 uint8_t udpRegisterHandler(uint8_t (*handler)(Packet *), uint16_t port) {
-    uint16_t i;
-
-    // Check if port is already in list
-    for (i = 0; i < udpRegisteredHandlers; i++) {
-        if (handlers[i].port == port) {
-            handlers[i].func = handler;
+    // Check if this handler is already in list
+    UdpHandler *h = NULL;
+    while ((h = findHandler(h, port)) != NULL) {
+        if (h->func == handler) {
             return 0;
         }
     }
 
-    // Extend list, add new handler.
-    UdpHandler *tmp = (UdpHandler *)mrealloc(handlers, (udpRegisteredHandlers + 1) * sizeof(UdpHandler), udpRegisteredHandlers * sizeof(UdpHandler));
-    if (tmp == NULL) {
+    // Add new handler
+    h = (UdpHandler *)slabAlloc(&udpHandlerSlab);
+    if (h == NULL) {
         return 1;
     }
-    handlers = tmp;
-    handlers[udpRegisteredHandlers].port = port;
-    handlers[udpRegisteredHandlers].func = handler;
+    h->port = port;
+    h->func = handler;
+    h->next = handlers;
+    handlers = h;
     udpRegisteredHandlers++;
     return 0;
 }
 
-uint8_t udpSendPacket(Packet *p, uint8_t *targetIp, uint16_t targetPort, uint16_t sourcePort) {
-    uint8_t i;
+uint8_t udpSendPacketClass(Packet *p, uint8_t *targetIp, uint16_t targetPort, uint16_t sourcePort, uint8_t txClass) {
+    uint8_t *h;
 #ifndef DISABLE_UDP_CHECKSUM
     uint16_t cs;
 #endif
 
-    // We have to write ip addresses before calculating the checksum...
-    for (i = 0; i < 4; i++) {
-        p->d[MACPreambleSize + IPv4PacketSourceOffset + i] = ownIpAddress[i];
-        p->d[MACPreambleSize + IPv4PacketDestinationOffset + i] = targetIp[i];
-    }
-    set16Bit(p->d, UDPOffset + UDPSourceOffset, sourcePort);
-    set16Bit(p->d, UDPOffset + UDPDestinationOffset, targetPort);
-    set16Bit(p->d, UDPOffset + UDPLengthOffset, p->dLength - UDPOffset);
+    h = packetPush(p, UDPDataOffset);
+    p->l4 = packetHeadroom(p);
+    set16Bit(h, UDPSourceOffset, sourcePort);
+    set16Bit(h, UDPDestinationOffset, targetPort);
+    set16Bit(h, UDPLengthOffset, packetLength(p));
+    h[UDPChecksumOffset] = 0;
+    h[UDPChecksumOffset + 1] = 0;
 #ifndef DISABLE_UDP_CHECKSUM
-    cs = udpChecksum(p);
-    set16Bit(p->d, UDPOffset + UDPChecksumOffset, cs);
+    cs = udpChecksum(p, netRoute(targetIp)->ip, targetIp);
+    if (cs == 0x0000) {
+        cs = 0xFFFF; // 0 means no checksum
+    }
+    set16Bit(h, UDPChecksumOffset, cs);
 #endif
-    return ipv4SendPacket(p, targetIp, UDP);
+    netCount(udp.tx);
+    return ipv4SendPacket(p, targetIp, UDP, IPV4_TOS_DEFAULT, txClass);
 }
 
 #endif // DISABLE_UDP
@@ -36,6 +36,7 @@
 
 #include <net/mac.h>
 #include <net/controller.h>
+#include <net/utils.h>
 
 uint8_t isValue(uint8_t *x, uint16_t l, uint8_t c) {
     uint16_t i;
@@ -80,3 +81,70 @@ void dumpPacketRaw(Packet *p) {
     debugPrint("\n");
 #endif
 }
+
+PacketHandler protocolFind(ProtocolTable *t, uint16_t type) {
+    uint8_t lo = 0, hi = t->count, mid;
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (t->handlers[mid].type == type) {
+            return t->handlers[mid].handler;
+        } else if (t->handlers[mid].type < type) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return NULL;
+}
+
+uint8_t protocolRegister(ProtocolTable *t, uint16_t type, PacketHandler handler) {
+    uint8_t i, j;
+    for (i = 0; (i < t->count) && (t->handlers[i].type < type); i++);
+
+    if ((i < t->count) && (t->handlers[i].type == type)) {
+        if (handler != NULL) {
+            t->handlers[i].handler = handler; // Replace
+        } else {
+            for (j = i + 1; j < t->count; j++) {
+                t->handlers[j - 1] = t->handlers[j]; // Remove
+            }
+            t->count--;
+        }
+        return 0;
+    }
+
+    if (handler == NULL) {
+        return 0; // Nothing to remove
+    }
+    if (t->count >= t->size) {
+        return 1;
+    }
+    for (j = t->count; j > i; j--) {
+        t->handlers[j] = t->handlers[j - 1]; // Make room, stay sorted
+    }
+    t->handlers[i].type = type;
+    t->handlers[i].handler = handler;
+    t->count++;
+    return 0;
+}
+
+uint8_t tokenBucketTake(TokenBucket *b) {
+    tick_t now = getSystemTime();
+    tick_t d = diffTime(now, b->last);
+    uint32_t add = b->burst; // Idle for long enough to be full
+    if (d < (1000UL * b->burst)) {
+        add = (d * b->rate) / 1000; // Does not overflow
+    }
+    if ((b->tokens + add) >= b->burst) {
+        b->tokens = b->burst;
+        b->last = now;
+    } else if (add > 0) {
+        b->tokens += add;
+        b->last += (add * 1000) / b->rate; // Keep the fraction of a token
+    }
+    if (b->tokens == 0) {
+        return 0;
+    }
+    b->tokens--;
+    return 1;
+}
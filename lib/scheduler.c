@@ -30,91 +30,227 @@
 /*
  * A very simple task scheduler. Each task can be executed once
  * or in different frequencies, from 1ms between each execution
- * up to (2^64 - 1)ms
+ * up to (2^31 - 1)ms
  * Add tasks with addTimedTasks(foo, 1000, repeat);
  * Then Execute them in the main loop with while(1) { scheduler(); }
+ *
+ * Running timers are kept in a binary min-heap, ordered by their
+ * absolute deadline, so the next due timer is always schedulerHeap[0].
+ * Every timer knows its heap position, so it can be removed in O(log n).
  */
 #include <stdlib.h>
 #include <stdint.h>
 #include <avr/io.h>
 #include <avr/interrupt.h>
+#include <avr/pgmspace.h>
 
 #include <std.h>
+#include <slab.h>
 #include <time.h>
 #include <scheduler.h>
+#include <net/controller.h> // TimersMaxDynamic
+
+#define TIMER_ALLOCATED 0x01 // Allocated by addTimedTask(), freed when done
 
-typedef struct SchedElement SchedElement;
-struct SchedElement {
-    Task task;
-    time_t intervall;
-    time_t counter;
-    uint8_t repeat;
-    SchedElement* next;
-};
+SLAB(timerSlab, Timer, TimersMaxDynamic);
+Timer *schedulerHeap[SCHEDULER_MAX];
+uint8_t schedulerCount = 0;
 
-SchedElement *schedulerList = NULL; // Single-linked-list
+// Wrap-safe, as long as deadlines are less than 2^31ms away
+#define isDue(deadline, now) ((int32_t)((deadline) - (now)) <= 0)
+#define isBefore(a, b) ((int32_t)((a)->deadline - (b)->deadline) < 0)
+
+// ----------------------
+// |      Internal      |
+// ----------------------
+
+void schedulerPlace(uint8_t i, Timer *t) {
+    schedulerHeap[i] = t;
+    t->index = i;
+}
+
+void schedulerSiftUp(uint8_t i) {
+    Timer *t = schedulerHeap[i];
+    while (i > 0) {
+        uint8_t parent = (i - 1) / 2;
+        if (!isBefore(t, schedulerHeap[parent])) {
+            break;
+        }
+        schedulerPlace(i, schedulerHeap[parent]);
+        i = parent;
+    }
+    schedulerPlace(i, t);
+}
+
+void schedulerSiftDown(uint8_t i) {
+    Timer *t = schedulerHeap[i];
+    uint8_t child;
+    while ((child = (2 * i) + 1) < schedulerCount) {
+        if (((child + 1) < schedulerCount)
+                && isBefore(schedulerHeap[child + 1], schedulerHeap[child])) {
+            child++;
+        }
+        if (!isBefore(schedulerHeap[child], t)) {
+            break;
+        }
+        schedulerPlace(i, schedulerHeap[child]);
+        i = child;
+    }
+    schedulerPlace(i, t);
+}
+
+void schedulerRemove(Timer *t) {
+    uint8_t i = t->index;
+    t->index = TIMER_STOPPED;
+    if (i != --schedulerCount) {
+        // Fill the hole with the last element and restore the heap
+        schedulerPlace(i, schedulerHeap[schedulerCount]);
+        schedulerSiftUp(i);
+        schedulerSiftDown(i);
+    }
+}
 
 // ----------------------
 // |    External API    |
 // ----------------------
 
-// 0 on success
-uint8_t addTimedTask(Task func, time_t intervall, uint8_t repeat) {
-    // Allocate new list element
-    SchedElement *t = (SchedElement *)mmalloc(sizeof(SchedElement));
-    if (t == NULL) {
+void timerInit(Timer *t, Task func) {
+    t->task = func;
+    t->period = 0;
+    t->index = TIMER_STOPPED;
+    t->flags = 0;
+#ifndef DISABLE_TASK_PROFILING
+    t->stats.calls = 0;
+    t->stats.time = 0;
+    t->stats.max = 0;
+    t->stats.late = 0;
+#endif
+}
+
+// 0 on success, 1 if too many timers are running
+uint8_t timerStart(Timer *t, tick_t timeout, tick_t period) {
+    t->deadline = schedulerTimeFunc() + timeout;
+    t->period = period;
+    if (t->index != TIMER_STOPPED) {
+        // Already running, just move it
+        schedulerSiftUp(t->index);
+        schedulerSiftDown(t->index);
+        return 0;
+    }
+    if (schedulerCount >= SCHEDULER_MAX) {
         return 1;
     }
+    schedulerPlace(schedulerCount, t);
+    schedulerSiftUp(schedulerCount++);
+    return 0;
+}
+
+void timerCancel(Timer *t) {
+    if (t->index != TIMER_STOPPED) {
+        schedulerRemove(t);
+    }
+}
 
-    // Fill with data
-    t->task = func;
-    t->intervall = intervall;
-    t->repeat = repeat;
+uint8_t timerIsRunning(Timer *t) {
+    return (t->index != TIMER_STOPPED);
+}
+
+tick_t timerRemaining(Timer *t) {
+    tick_t now = schedulerTimeFunc();
+    if (t->index == TIMER_STOPPED) {
+        return SCHEDULER_IDLE;
+    }
+    if (isDue(t->deadline, now)) {
+        return 0;
+    }
+    return t->deadline - now;
+}
 
-    // Put in front of list
-    t->next = schedulerList;
-    schedulerList = t;
+// 0 on success
+uint8_t addTimedTask(Task func, tick_t intervall, uint8_t repeat) {
+    Timer *t = (Timer *)slabAlloc(&timerSlab);
+    if (t == NULL) {
+        return 1;
+    }
+    timerInit(t, func);
+    t->flags = TIMER_ALLOCATED;
+    if (timerStart(t, intervall, repeat ? intervall : 0) != 0) {
+        slabFree(&timerSlab, t);
+        return 1;
+    }
     return 0;
 }
 
+uint8_t timerStartStatic(const TimerDescriptor *d, Timer *t, uint8_t count) {
+    TimerDescriptor desc;
+    uint8_t i, r = 0;
+    for (i = 0; i < count; i++) {
+        memcpy_P(&desc, &d[i], sizeof(TimerDescriptor));
+        timerInit(&t[i], desc.task);
+        r |= timerStart(&t[i], desc.timeout, desc.period);
+    }
+    return r;
+}
+
 uint8_t schedulerRegistered(void) {
-    SchedElement *t = schedulerList;
-    uint8_t count = 0;
-    while (t != NULL) {
-        count++;
-        t = t->next;
+    return schedulerCount;
+}
+
+#ifndef DISABLE_TASK_PROFILING
+TaskStats *timerGetStats(uint8_t i, Task *func) {
+    if (i >= schedulerCount) {
+        return NULL;
+    }
+    if (func != NULL) {
+        *func = schedulerHeap[i]->task;
     }
-    return count;
+    return &schedulerHeap[i]->stats;
 }
+#endif
 
 void scheduler(void) {
-    time_t t = schedulerTimeFunc(), d;
-    static time_t lastTimeSchedulerWasCalled = 0;
-    SchedElement *p = schedulerList, *previous = NULL;
-
-    // Execute Timed Tasks
-    d = diffTime(lastTimeSchedulerWasCalled, t);
-    if (d > 0) {
-        while (p != NULL) {
-            p->counter += d;
-            if (p->counter >= p->intervall) {
-                p->counter = 0;
-                p->task();
-                if (p->repeat == 0) {
-                    if (p == schedulerList) {
-                        schedulerList = p->next;
-                        mfree(p, sizeof(SchedElement));
-                        p = schedulerList;
-                    } else {
-                        previous->next = p->next;
-                        mfree(p, sizeof(SchedElement));
-                        p = previous->next;
-                    }
-                }
-            }
-            previous = p;
-            p = p->next;
+    tick_t now = schedulerTimeFunc();
+    uint8_t n = schedulerCount; // Bound the work done per call
+    Timer *t;
+#ifndef DISABLE_TASK_PROFILING
+    tick_t late;
+    uint32_t start;
+#endif
+
+    while ((n-- > 0) && (schedulerCount > 0)
+            && isDue(schedulerHeap[0]->deadline, now)) {
+        t = schedulerHeap[0];
+#ifndef DISABLE_TASK_PROFILING
+        late = now - t->deadline;
+        if (late > t->stats.late) {
+            t->stats.late = (late > 0xFFFF) ? 0xFFFF : late;
+        }
+#endif
+        if (t->period != 0) {
+            // Keep the phase. If we're late, the next run is due
+            // immediately and will be caught up on the next call.
+            t->deadline += t->period;
+            schedulerSiftDown(0);
+        } else {
+            // Stop before calling, so the task may restart its timer
+            schedulerRemove(t);
+        }
+#ifndef DISABLE_TASK_PROFILING
+        start = getSystemTimeUs();
+        t->task();
+        taskStatsUpdate(&t->stats, start);
+#else
+        t->task();
+#endif
+        if ((t->flags & TIMER_ALLOCATED) && (t->index == TIMER_STOPPED)) {
+            slabFree(&timerSlab, t);
         }
-        lastTimeSchedulerWasCalled = t;
     }
 }
+
+tick_t schedulerNextDeadline(void) {
+    if (schedulerCount == 0) {
+        return SCHEDULER_IDLE;
+    }
+    return timerRemaining(schedulerHeap[0]);
+}
@@ -0,0 +1,61 @@
+/*
+ * slab.c
+ *
+ * Copyright (c) 2012, Thomas Buck <xythobuz@me.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdlib.h>
+#include <stdint.h>
+
+#define DEBUG 0
+
+#include <slab.h>
+#include <net/controller.h>
+
+void *slabAlloc(Slab *s) {
+    void *p;
+    if (s->free != NULL) {
+        p = s->free;
+        s->free = *((void **)p);
+    } else if (s->fresh < s->count) {
+        p = s->memory + (s->fresh++ * s->size);
+    } else {
+        s->fails++;
+        debugPrint("Slab is full!\n");
+        return NULL;
+    }
+    if (++s->used > s->peak) {
+        s->peak = s->used;
+    }
+    return p;
+}
+
+void slabFree(Slab *s, void *p) {
+    assert(((uint8_t *)p >= s->memory) && ((uint8_t *)p < (s->memory + (s->count * s->size))));
+    *((void **)p) = s->free;
+    s->free = p;
+    s->used--;
+}
@@ -29,87 +29,236 @@
  */
 #include <stdlib.h>
 #include <stdint.h>
+#include <avr/io.h>
 
 #define DEBUG 0
 
 #include <std.h>
+#include <scheduler.h>
 #include <net/controller.h> // Maybe DISABLE_HEAP_LOG is defined here?
 
-uint32_t heapBytesAllocated = 0;
-
 #ifndef DISABLE_HEAP_LOG
 
-void *mmalloc(size_t size) {
-    void *p = malloc(size);
-    if (p != NULL) {
-        heapBytesAllocated += (size);
-#if DEBUG >= 1
-        debugPrint("  + ");
-        debugPrint(timeToString(size));
-        debugPrint("\n");
-#endif
-    }
-    return p;
-}
+// Stored in front of every allocation
+typedef struct {
+    uint16_t size;
+    uint8_t site; // Index in heapSites
+} HeapHeader;
 
-void *mrealloc(void *ptr, size_t newSize, size_t oldSize) {
-    void *p = realloc(ptr, newSize);
-    if (p != NULL) {
-        heapBytesAllocated += newSize;
-        heapBytesAllocated -= oldSize;
-#if DEBUG >= 1
-        if (newSize > oldSize) {
-            debugPrint("  + ");
-            debugPrint(timeToString(newSize - oldSize));
-        } else {
-            debugPrint("  - ");
-            debugPrint(timeToString(oldSize - newSize));
+uint32_t heapBytesAllocated = 0;
+uint32_t heapBytesPeak = 0;
+uint16_t heapFailures = 0;
+HeapSite heapSites[HEAPSITES];
+
+// Entry for this call site. Entries without outstanding blocks are
+// reused, sites that don't fit anymore share the last entry.
+uint8_t heapSite(uint8_t tag, uint16_t line) {
+    uint8_t i, unused = HEAPSITES - 1;
+    for (i = 0; i < (HEAPSITES - 1); i++) {
+        if ((heapSites[i].line == line) && (heapSites[i].tag == tag)) {
+            return i;
         }
-        debugPrint("\n");
-#endif
+        if ((heapSites[i].count == 0) && (unused == (HEAPSITES - 1))) {
+            unused = i;
+        }
+    }
+    if (unused == (HEAPSITES - 1)) {
+        line = 0;
+        tag = HEAP_TAG_OTHER;
     }
-    return p;
+    heapSites[unused].line = line;
+    heapSites[unused].tag = tag;
+    return unused;
 }
 
-void *mcalloc(size_t n, size_t s) {
-    void *p = calloc(n, s);
-    if (p != NULL) {
-        heapBytesAllocated += (n * s);
+void heapAdd(HeapHeader *h) {
+    heapBytesAllocated += h->size;
+    if (heapBytesAllocated > heapBytesPeak) {
+        heapBytesPeak = heapBytesAllocated;
+    }
+    heapSites[h->site].count++;
+    heapSites[h->site].bytes += h->size;
 #if DEBUG >= 1
-        debugPrint("  + ");
-        debugPrint(timeToString(n * s));
-        debugPrint("\n");
+    debugPrint("  + ");
+    debugPrint(timeToString(h->size));
+    debugPrint("\n");
 #endif
-    }
-    return p;
 }
 
-void mfree(void *ptr, size_t size) {
-    free(ptr);
-    heapBytesAllocated -= size;
+void heapRemove(HeapHeader *h) {
+    heapBytesAllocated -= h->size;
+    heapSites[h->site].count--;
+    heapSites[h->site].bytes -= h->size;
 #if DEBUG >= 1
     debugPrint("  - ");
-    debugPrint(timeToString(size));
+    debugPrint(timeToString(h->size));
     debugPrint("\n");
 #endif
 }
 
-#else // DISABLE_HEAP_LOG defined
-
-inline void *mmalloc(size_t size) {
-    return malloc(size);
+void *heapAlloc(size_t size, uint8_t tag, uint16_t line) {
+    HeapHeader *h = (HeapHeader *)malloc(sizeof(HeapHeader) + size);
+    if (h == NULL) {
+        heapFailures++;
+        return NULL;
+    }
+    h->size = size;
+    h->site = heapSite(tag, line);
+    heapAdd(h);
+    return h + 1;
 }
 
-inline void *mrealloc(void *ptr, size_t newSize, size_t oldSize) {
-    return realloc(ptr, newSize);
+void *heapRealloc(void *ptr, size_t newSize, uint8_t tag, uint16_t line) {
+    HeapHeader *h;
+    if (ptr == NULL) {
+        return heapAlloc(newSize, tag, line);
+    }
+    h = (HeapHeader *)ptr - 1;
+    heapRemove(h);
+    ptr = realloc(h, sizeof(HeapHeader) + newSize);
+    if (ptr == NULL) {
+        heapFailures++;
+        heapAdd(h); // Old block is still valid
+        return NULL;
+    }
+    h = (HeapHeader *)ptr;
+    h->size = newSize;
+    h->site = heapSite(tag, line); // Resized here, blame this site
+    heapAdd(h);
+    return h + 1;
 }
 
-inline void *mcalloc(size_t n, size_t s) {
-    return calloc(n, s);
+void *heapCalloc(size_t n, size_t s, uint8_t tag, uint16_t line) {
+    HeapHeader *h = (HeapHeader *)calloc(1, sizeof(HeapHeader) + (n * s));
+    if (h == NULL) {
+        heapFailures++;
+        return NULL;
+    }
+    h->size = n * s;
+    h->site = heapSite(tag, line);
+    heapAdd(h);
+    return h + 1;
 }
 
-inline void mfree(void *ptr, size_t size) {
-    free(ptr);
+void heapFree(void *ptr, size_t size) {
+    HeapHeader *h;
+    if (ptr == NULL) {
+        return;
+    }
+    h = (HeapHeader *)ptr - 1;
+    assert(h->size == size); // Caller gave the wrong size before
+    heapRemove(h);
+    free(h);
 }
 
 #endif // DISABLE_HEAP_LOG
+
+#ifndef DISABLE_HEAP
+
+// From avr-libc malloc
+struct __freelist {
+    size_t sz;
+    struct __freelist *nx;
+};
+extern struct __freelist *__flp;
+extern char *__brkval; // Top of the heap, NULL before the first malloc
+
+size_t heapLargestFree(void) {
+    struct __freelist *f;
+    char *top = __brkval, *end = __malloc_heap_end;
+    size_t max = 0;
+
+    for (f = __flp; f != NULL; f = f->nx) {
+        if (f->sz > max) {
+            max = f->sz;
+        }
+    }
+
+    // Space above the heap, up to the stack
+    if (top == NULL) {
+        top = __malloc_heap_start;
+    }
+    if (end == NULL) {
+        end = (char *)SP - __malloc_margin;
+    }
+    if ((end > top) && ((size_t)(end - top) > (max + sizeof(size_t)))) {
+        max = end - top - sizeof(size_t);
+    }
+    return max;
+}
+
+#endif // DISABLE_HEAP
+
+// -----------------------------
+// |      Stack Painting       |
+// -----------------------------
+
+extern uint8_t _end; // Declared in linker script, end of .bss
+
+uint16_t stackMinFree = 0xFFFF;
+uint16_t stackAlarmLimit = STACK_ALARM;
+StackAlarm stackAlarmHandler = NULL;
+Timer stackTimer; // Runs stackCheck()
+
+// Runs after the stack pointer has been set up, before .data and .bss
+// are initialized. Those lie below _end, so they are not touched.
+void stackPaint(void) __attribute__((naked)) __attribute__((section(".init3")));
+void stackPaint(void) {
+    uint8_t *p = &_end;
+    while (p <= (uint8_t *)SP) {
+        *p++ = STACK_CANARY;
+    }
+}
+
+#ifndef DISABLE_HEAP
+uint8_t *stackHeapTop = NULL; // Highest __brkval seen so far
+#endif
+
+uint16_t stackUnusedBytes(void) {
+    uint8_t *p = &_end;
+    uint16_t count = 0;
+
+#ifndef DISABLE_HEAP
+    // free() can lower __brkval, but the old heap data stays above it
+    if ((uint8_t *)__brkval > stackHeapTop) {
+        stackHeapTop = (uint8_t *)__brkval;
+    }
+    if (stackHeapTop > p) {
+        p = stackHeapTop;
+    }
+    // The heap may have grown and shrunk again between two checks
+    while ((p <= (uint8_t *)SP) && (*p != STACK_CANARY)) {
+        p++;
+    }
+#endif
+    while ((p <= (uint8_t *)SP) && (*p == STACK_CANARY)) {
+        p++;
+        count++;
+    }
+    return count;
+}
+
+void stackCheck(void) {
+    uint16_t unused = stackUnusedBytes();
+    if (unused < stackMinFree) {
+        stackMinFree = unused;
+        if ((unused < stackAlarmLimit) && (stackAlarmHandler != NULL)) {
+            stackAlarmHandler(unused); // Only once for every new minimum
+        }
+    }
+}
+
+void stackSetAlarm(uint16_t limit, StackAlarm handler) {
+    stackAlarmLimit = limit;
+    stackAlarmHandler = handler;
+    stackCheckStart();
+}
+
+void stackCheckStart(void) {
+    if (stackTimer.task == NULL) {
+        timerInit(&stackTimer, stackCheck);
+    }
+    if (!timerIsRunning(&stackTimer)) {
+        timerStart(&stackTimer, STACK_CHECK_INTERVAL, STACK_CHECK_INTERVAL);
+    }
+}
@@ -29,24 +29,170 @@
  */
 #include <stdlib.h>
 #include <stdint.h>
+#include <avr/pgmspace.h>
+#include <util/atomic.h>
 
 #define DEBUG 1
 
 #include <std.h>
+#include <slab.h>
+#include <time.h>
 #include <tasks.h>
 #include <net/controller.h>
 
-typedef struct TaskElement TaskElement;
-struct TaskElement {
-    Task task;
-    TestFunc test;
-    TaskElement *next;
-#if DEBUG >= 1
-    char *name;
+#define TASK_FLASH 0x01 // Descriptor is stored in flash
+
+// Tasks added at runtime keep their descriptor in RAM
+typedef struct {
+    TaskElement e;
+    TaskDescriptor d;
+} DynamicTask;
+
+SLAB(taskSlab, DynamicTask, TasksMaxDynamic);
+TaskElement *taskList = NULL; // Sorted by priority
+volatile uint16_t taskEvents = 0; // Posted, but not yet handled
+uint8_t taskEventsUsed = 0;
+
+// ----------------------
+// |      Internal      |
+// ----------------------
+
+// Read single descriptor fields, from flash if needed
+
+uint8_t taskPriority(TaskElement *p) {
+    if (p->flags & TASK_FLASH) {
+        return pgm_read_byte(&p->desc->priority);
+    }
+    return p->desc->priority;
+}
+
+uint8_t *taskEventPointer(TaskElement *p) {
+    if (p->flags & TASK_FLASH) {
+        return (uint8_t *)pgm_read_word(&p->desc->event);
+    }
+    return p->desc->event;
+}
+
+Task taskFunction(TaskElement *p) {
+    if (p->flags & TASK_FLASH) {
+        return (Task)pgm_read_word(&p->desc->task);
+    }
+    return p->desc->task;
+}
+
+TestFunc taskTest(TaskElement *p) {
+    if (p->flags & TASK_FLASH) {
+        return (TestFunc)pgm_read_word(&p->desc->test);
+    }
+    return p->desc->test;
+}
+
+char *taskName(TaskElement *p) {
+    if (p->flags & TASK_FLASH) {
+        return (char *)pgm_read_word(&p->desc->name);
+    }
+    return p->desc->name;
+}
+
+// 0 on success
+uint8_t insertTask(TaskElement *p) {
+    TaskElement **l = &taskList;
+    uint8_t *event = taskEventPointer(p);
+    uint8_t priority = taskPriority(p);
+
+    p->event = 0;
+#ifndef DISABLE_TASK_PROFILING
+    p->stats.calls = 0;
+    p->stats.time = 0;
+    p->stats.max = 0;
+    p->stats.late = 0;
 #endif
-};
+    if (event != NULL) {
+        if (taskEventsUsed >= TASK_EVENTS_MAX) {
+            *event = TASK_NO_EVENT;
+            return 1;
+        }
+        *event = taskEventsUsed;
+        p->event = 1U << taskEventsUsed++;
+    }
+
+    // In front of the first task with the same or lower priority
+    while ((*l != NULL) && (taskPriority(*l) < priority)) {
+        l = &((*l)->next);
+    }
+    p->next = *l;
+    *l = p;
+    return 0;
+}
+
+uint8_t newTask(Task func, TestFunc testFunc, char *name, uint8_t priority, uint8_t *event) {
+    DynamicTask *p = (DynamicTask *)slabAlloc(&taskSlab);
+    if (p == NULL) {
+        if (event != NULL) {
+            *event = TASK_NO_EVENT;
+        }
+        return 1;
+    }
+    p->d.task = func;
+    p->d.test = testFunc;
+    p->d.name = name;
+    p->d.priority = priority;
+    p->d.event = event;
+    p->e.desc = &p->d;
+    p->e.flags = 0;
+    if (insertTask(&p->e) != 0) {
+        slabFree(&taskSlab, p);
+        return 1;
+    }
+    p->d.event = NULL; // Only needed while inserting
+    return 0;
+}
+
+uint16_t peekEvents(void) {
+    uint16_t e;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        e = taskEvents;
+    }
+    return e;
+}
+
+uint16_t fetchEvents(void) {
+    uint16_t e;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        e = taskEvents;
+        taskEvents = 0;
+    }
+    return e;
+}
+
+// ----------------------
+// |    External API    |
+// ----------------------
 
-TaskElement *taskList = NULL;
+#ifndef DISABLE_TASK_PROFILING
+void taskStatsUpdate(TaskStats *s, uint32_t start) {
+    uint32_t d = getSystemTimeUs() - start;
+    s->calls++;
+    s->time += d;
+    if (d > s->max) {
+        s->max = (d > 0xFFFF) ? 0xFFFF : d;
+    }
+}
+
+TaskStats *taskGetStats(uint8_t i, char **name) {
+    TaskElement *p = taskList;
+    while ((p != NULL) && (i-- > 0)) {
+        p = p->next;
+    }
+    if (p == NULL) {
+        return NULL;
+    }
+    if (name != NULL) {
+        *name = taskName(p);
+    }
+    return &p->stats;
+}
+#endif
 
 uint8_t tasksRegistered(void) {
     uint8_t c = 0;
@@ -57,31 +203,85 @@ uint8_t tasksRegistered(void) {
 }
 
 uint8_t addTask(Task func, TestFunc testFunc, char *name) {
-    TaskElement *p = (TaskElement *)mmalloc(sizeof(TaskElement));
-    if (p == NULL) {
-        return 1;
+    return addTaskPriority(func, testFunc, name, TASK_PRIORITY_NORMAL);
+}
+
+uint8_t addTaskPriority(Task func, TestFunc testFunc, char *name, uint8_t priority) {
+    return newTask(func, testFunc, name, priority, NULL);
+}
+
+uint8_t addEventTask(Task func, char *name, uint8_t priority) {
+    uint8_t event;
+    newTask(func, NULL, name, priority, &event);
+    return event;
+}
+
+uint8_t addStaticTasks(const TaskDescriptor *d, TaskElement *e, uint8_t count) {
+    uint8_t i, r = 0;
+    for (i = 0; i < count; i++) {
+        e[i].desc = &d[i];
+        e[i].flags = TASK_FLASH;
+        r |= insertTask(&e[i]);
     }
-    p->task = func;
-    p->test = testFunc;
-    p->next = taskList;
-#if DEBUG >= 1
-    p->name = name;
-#endif
-    taskList = p;
-    return 0;
+    return r;
 }
 
-void tasks(void) {
-    for (TaskElement *p = taskList; p != NULL; p = p->next) {
-        if ((p->test == NULL) || (p->test() != 0)) {
-            p->task();
+void taskPost(uint8_t event) {
+    if (event < taskEventsUsed) {
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+            taskEvents |= 1U << event;
+        }
+    }
+}
+
+uint8_t tasksPending(void) {
+    return (peekEvents() != 0);
+}
+
+uint8_t tasks(void) {
+    uint8_t c = 0;
+    uint16_t events = fetchEvents();
+    uint16_t higher = 0; // Events of the tasks we already passed
+    TaskElement *p = taskList;
+    TestFunc test;
+#ifndef DISABLE_TASK_PROFILING
+    uint32_t start;
+#endif
+
+    while (p != NULL) {
+        if ((p->event != 0) && !(events & p->event)) {
+            // Event task without posted event
+            higher |= p->event;
+            p = p->next;
+            continue;
+        }
+        if ((p->event != 0) || ((test = taskTest(p)) == NULL) || (test() != 0)) {
+            events &= ~p->event;
+#ifndef DISABLE_TASK_PROFILING
+            start = getSystemTimeUs();
+            taskFunction(p)();
+            taskStatsUpdate(&p->stats, start);
+#else
+            taskFunction(p)();
+#endif
+            c++;
 #if DEBUG >= 1
-            if (p->name != NULL) {
+            if (taskName(p) != NULL) {
                 debugPrint("Executed ");
-                debugPrint(p->name);
+                debugPrint(taskName(p));
                 debugPrint("\n");
             }
 #endif
+            if (peekEvents() & higher) {
+                // Work for a more important task, start again
+                events |= fetchEvents();
+                higher = 0;
+                p = taskList;
+                continue;
+            }
         }
+        higher |= p->event;
+        p = p->next;
     }
+    return c;
 }
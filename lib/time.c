@@ -32,6 +32,7 @@
 #include <avr/io.h>
 #include <avr/interrupt.h>
 #include <util/atomic.h>
+#include <avr/sleep.h>
 
 #include <std.h>
 #include <time.h>
@@ -45,8 +46,65 @@
 // Prescaler 64
 // Count to 250
 // => 1 Interrupt per millisecond
+//
+// With TIMER_TICKLESS, the prescaler is 1024 and the period can be
+// stretched up to 256 counts (16ms @ 16MHz) while sleeping.
+// Every ISR adds the counts of the period that just ended to countAccu,
+// which is converted to milliseconds exactly, even if the number of
+// counts per millisecond is not an integer.
 
-volatile time_t systemTime = 0; // Unix Timestamp, Overflows in 500 million years... :)
+// The ISR only increments a 32bit counter. This is much cheaper than
+// a 64bit increment and can be read with interrupts disabled for a few cycles.
+volatile tick_t systemTicks = 0; // Milliseconds since system start
+volatile uint16_t systemTickWraps = 0; // Overflows of systemTicks
+
+// Wall clock, as UNIX time in ms at systemTicks == 0.
+time_t epochOffset = 0;
+uint8_t epochIsSet = 0;
+
+// Timer counts per millisecond are COUNTSNUM / COUNTSDEN
+#ifndef TIMER_TICKLESS
+#if F_CPU == 16000000
+#define PRESCALER (1 << CS22) // 64
+#define COUNTSNUM 250 // 250 counts per ms
+#define COUNTSDEN 1
+#elif F_CPU == 20000000
+#define PRESCALER ((1 << CS22) | (1 << CS21)) // 256
+#define COUNTSNUM 625 // 78.125 counts per ms
+#define COUNTSDEN 8
+#else
+#error F_CPU not compatible with timer module. DIY!
+#endif
+#else // TIMER_TICKLESS
+#if F_CPU == 16000000
+#define PRESCALER ((1 << CS22) | (1 << CS21) | (1 << CS20)) // 1024
+#define COUNTSNUM 125 // 15.625 counts per ms
+#define COUNTSDEN 8
+#elif F_CPU == 20000000
+#define PRESCALER ((1 << CS22) | (1 << CS21) | (1 << CS20)) // 1024
+#define COUNTSNUM 625 // 19.53125 counts per ms
+#define COUNTSDEN 32
+#else
+#error F_CPU not compatible with timer module. DIY!
+#endif
+#endif // TIMER_TICKLESS
+
+#define TICKPERIOD (COUNTSNUM / COUNTSDEN) // Counts per regular interrupt
+#define USPERCOUNT ((1000UL << 16) / COUNTSNUM) // us per scaled count, 16.16
+
+volatile uint16_t countAccu = 0; // Scaled counts not yet added to systemTicks
+volatile uint16_t timerPeriod = TICKPERIOD; // Counts of the running period
+
+// Clock discipline. timerTrim is added to countAccu for every count,
+// in scaled counts as 8.24 fixed point. It is the sum of the frequency
+// correction and, while an offset is slewed, +-SLEWRATE.
+#define SLEWRATE 500 // ppm
+volatile int32_t timerTrim = 0;
+int32_t trimAccu = 0; // Fraction of timerTrim not yet added, ISR only
+int32_t frequencyPpb = 0;
+int32_t frequencyTrim = 0;
+volatile uint32_t slewTicks = 0; // Milliseconds the slew is still applied
+int8_t slewSign = 0;
 
 // Currently works with ATmega168, 32, 2560
 #if defined(__AVR_ATmega168__) || defined(__AVR_ATmega2560__)
@@ -55,12 +113,16 @@ volatile time_t systemTime = 0; // Unix Timestamp, Overflows in 500 million year
 #define OCR OCR2A
 #define TIMS TIMSK2
 #define OCIE OCIE2A
+#define TIFS TIFR2
+#define OCF OCF2A
 #elif defined(__AVR_ATmega32__)
 #define TCRA TCCR2
 #define TCRB TCCR2
 #define OCR OCR2
 #define TIMS TIMSK
 #define OCIE OCIE2
+#define TIFS TIFR
+#define OCF OCF2
 #else
 #error MCU not compatible with timer module. DIY!
 #endif
@@ -68,17 +130,8 @@ volatile time_t systemTime = 0; // Unix Timestamp, Overflows in 500 million year
 void initSystemTimer() {
     // Timer initialization
     TCRA |= (1 << WGM21); // CTC Mode
-
-#if F_CPU == 16000000
-    TCRB |= (1 << CS22); // Prescaler: 64
-    OCR = 250;
-#elif F_CPU == 20000000
-    TCRB |= (1 << CS22) | (1 << CS21); // Prescaler 256
-    OCR = 78;
-#else
-#error F_CPU not compatible with timer module. DIY!
-#endif
-
+    TCRB |= PRESCALER;
+    OCR = TICKPERIOD - 1; // In CTC Mode, the timer period is OCR + 1 counts
     TIMS |= (1 << OCIE); // Enable compare match interrupt
 }
 
@@ -90,23 +143,131 @@ ISR(TIMER2_COMP_vect) {
 #else
 #error MCU not compatible with timer module. DIY!
 #endif
-    systemTime++;
+    countAccu += timerPeriod * COUNTSDEN;
+    if (timerTrim != 0) {
+        trimAccu += timerPeriod * timerTrim;
+        countAccu += (int16_t)(trimAccu >> 24); // Whole scaled counts
+        trimAccu &= 0x00FFFFFF;
+    }
+    while (countAccu >= COUNTSNUM) {
+        countAccu -= COUNTSNUM;
+        if (++systemTicks == 0) {
+            systemTickWraps++;
+        }
+        if (slewTicks != 0) {
+            if (--slewTicks == 0) {
+                timerTrim = frequencyTrim; // Offset completely slewed
+            }
+        }
+    }
+
+#ifdef TIMER_TICKLESS
+    if (timerPeriod != TICKPERIOD) {
+        // Stretched period is over, back to regular ticks
+        timerPeriod = TICKPERIOD;
+        OCR = TICKPERIOD - 1;
+    }
+#endif
+}
+
+#ifdef TIMER_TICKLESS
+void timerSleep(tick_t ms) {
+    uint32_t counts;
+    uint8_t c;
+
+    if (ms > 1000) {
+        ms = 1000; // Prevent overflow, the period is 256 counts max. anyways
+    }
+
+    cli();
+    if ((ms > 0) && !(TIFS & (1 << OCF))) {
+        // Counts from the start of this period until the wakeup.
+        // No compare match is pending, so countAccu belongs to this period.
+        counts = ((uint32_t)ms * COUNTSNUM) - countAccu;
+        counts = (counts + COUNTSDEN - 1) / COUNTSDEN;
+        if (counts > 256) {
+            counts = 256;
+        }
+        c = TCNT2;
+        if (counts > (c + 2)) {
+            // Enough time left to move the compare match safely
+            timerPeriod = counts;
+            OCR = counts - 1;
+        }
+    }
+    set_sleep_mode(SLEEP_MODE_IDLE); // Timer 2 is clocked synchronously
+    sleep_enable();
+    sei(); // The instruction after sei is always executed
+    sleep_cpu();
+    sleep_disable();
+
+    // If we were woken by something else, end the stretched period soon.
+    // The counts up to then are accounted by the ISR, so no time is lost.
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        if ((timerPeriod != TICKPERIOD) && !(TIFS & (1 << OCF))) {
+            c = TCNT2;
+            if ((c + 2) < TICKPERIOD) {
+                timerPeriod = TICKPERIOD;
+                OCR = TICKPERIOD - 1;
+            } else if (c < 253) {
+                timerPeriod = c + 3;
+                OCR = c + 2;
+            } // else the compare match is only a few counts away
+        }
+    }
 }
+#endif // TIMER_TICKLESS
 
-time_t getSystemTime(void) {
-    return systemTime;
+tick_t getSystemTime(void) {
+    tick_t t;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        t = systemTicks;
+    }
+    return t;
+}
+
+uint32_t getSystemTimeUs(void) {
+    uint32_t t;
+    uint16_t x;
+    uint8_t c;
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        t = systemTicks;
+        x = countAccu;
+        c = TCNT2;
+        if (TIFS & (1 << OCF)) {
+            // Period is over, but the ISR has not yet run.
+            // Read the counter again, it could have been before the match.
+            c = TCNT2;
+            x += timerPeriod * COUNTSDEN;
+        }
+    }
+    x += c * COUNTSDEN; // Scaled counts since the last millisecond
+    return (t * 1000) + ((x * USPERCOUNT) >> 16);
+}
+
+// Uptime in ms, including the overflows of systemTicks
+time_t getUptime(void) {
+    time_t t;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        t = systemTickWraps;
+        t <<= 32;
+        t |= systemTicks;
+    }
+    return t;
 }
 
 time_t getSystemTimeSeconds(void) {
-    return systemTime / 1000;
+    return getUptime() / 1000;
 }
 
-time_t diffTime(time_t a, time_t b) {
-    if (a > b) {
-        return a - b;
-    } else {
-        return b - a;
+tick_t diffTime(tick_t a, tick_t b) {
+    tick_t d = a - b;
+    if (d > 0x7FFFFFFF) {
+        // b is later than a
+        d = b - a;
     }
+    return d;
 }
 
 uint8_t daysInMonth(uint8_t month, uint16_t year) {
@@ -135,11 +296,84 @@ uint8_t isLeapYear(uint16_t year) {
     return 0;
 }
 
+time_t getUnixTime(void) {
+    if (!epochIsSet) {
+        return 0;
+    }
+    return (epochOffset + getUptime()) / 1000;
+}
+
+time_t getUnixTimeMs(void) {
+    return epochOffset + getUptime();
+}
+
+uint8_t unixTimeIsSet(void) {
+    return epochIsSet;
+}
+
 void setTimestamp(time_t unix) {
+    setTimestampMs(unix * 1000);
+}
+
+void setTimestampMs(time_t unixMs) {
+    // Only the offset changes, the monotonic time keeps running
+    epochOffset = unixMs - getUptime();
+    epochIsSet = 1;
+}
+
+// Scaled counts per count for ppb, 8.24 fixed point
+int32_t ppbToTrim(int32_t ppb) {
+    return ((int64_t)ppb * COUNTSDEN * (1L << 24)) / 1000000000;
+}
+
+void timeSetFrequency(int32_t ppb) {
+    frequencyPpb = ppb;
+    frequencyTrim = ppbToTrim(ppb);
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        timerTrim = frequencyTrim;
+        if (slewTicks != 0) {
+            timerTrim += slewSign * ppbToTrim(SLEWRATE * 1000L);
+        }
+    }
+}
+
+int32_t timeGetFrequency(void) {
+    return frequencyPpb;
+}
+
+void timeAdjust(int32_t ms) {
+    uint32_t t;
+
+    if (ms > 1000000) {
+        ms = 1000000; // 2 million seconds of slewing is enough
+    } else if (ms < -1000000) {
+        ms = -1000000;
+    }
+
+    // At SLEWRATE ppm, one ms takes 1000000 / SLEWRATE ms.
+    if (ms >= 0) {
+        slewSign = 1;
+        t = ms * (1000000 / SLEWRATE);
+    } else {
+        slewSign = -1;
+        t = -ms * (1000000 / SLEWRATE);
+    }
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        slewTicks = t;
+        timerTrim = frequencyTrim;
+        if (t != 0) {
+            timerTrim += slewSign * ppbToTrim(SLEWRATE * 1000L);
+        }
+    }
+}
+
+int32_t timeAdjustRemaining(void) {
+    uint32_t t;
     ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
-        systemTime = unix;
-        systemTime *= 1000;
+        t = slewTicks;
     }
+    return slewSign * (int32_t)(t / (1000000 / SLEWRATE));
 }
 
 void setNtpTimestamp(time_t ntp) {
@@ -0,0 +1,185 @@
+/*
+ * main.c
+ *
+ * Copyright (c) 2012, Thomas Buck <xythobuz@me.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ *
+ * - Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+/*
+ * Receives frames captured by lib/net/capture.c and writes them to a
+ * pcap file, that can be opened with Wireshark. Use "-" as file to
+ * watch them live: ./pcapReceiver - | wireshark -k -i -
+ *
+ * UDP (CAPTURE_UDP): pcapReceiver file [port]
+ * Every datagram contains complete pcap records, the file header is
+ * written by us.
+ *
+ * Serial (CAPTURE_SERIAL): pcapReceiver file -s /dev/tty... [baud]
+ * The stream already is a pcap file, it is only copied.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <termios.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#define PORT 6601
+#define BAUD B38400
+
+#define BUFFSIZE 2048
+uint8_t buffer[BUFFSIZE];
+FILE *out;
+int s = -1;
+unsigned long frames = 0;
+
+void intHandler(int dummy);
+
+// Little endian, like the AVR
+void write32(uint32_t v) {
+    uint8_t d[4] = { v & 0xFF, (v >> 8) & 0xFF, (v >> 16) & 0xFF, v >> 24 };
+    fwrite(d, 1, 4, out);
+}
+
+uint32_t read32(uint8_t *d) {
+    return d[0] | (d[1] << 8) | (d[2] << 16) | ((uint32_t)d[3] << 24);
+}
+
+speed_t baudRate(int baud) {
+    switch (baud) {
+        case 9600: return B9600;
+        case 19200: return B19200;
+        case 38400: return B38400;
+        case 57600: return B57600;
+        case 115200: return B115200;
+    }
+    return BAUD;
+}
+
+int receiveSerial(char *device, speed_t baud) {
+    struct termios t;
+    ssize_t sz;
+
+    if ((s = open(device, O_RDONLY | O_NOCTTY)) == -1) {
+        fprintf(stderr, "Could not open %s!\n", device);
+        return 2;
+    }
+    tcgetattr(s, &t);
+    cfmakeraw(&t);
+    cfsetispeed(&t, baud);
+    cfsetospeed(&t, baud);
+    tcsetattr(s, TCSANOW, &t);
+
+    fprintf(stderr, "Copying pcap stream from %s\nStop with CTRL+C...\n", device);
+    while ((sz = read(s, buffer, BUFFSIZE)) > 0) {
+        fwrite(buffer, 1, sz, out);
+        fflush(out);
+    }
+    close(s);
+    return 0;
+}
+
+int receiveUdp(int port) {
+    struct sockaddr_in si;
+    ssize_t sz, i;
+    uint32_t length;
+
+    if ((s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) == -1) {
+        fprintf(stderr, "Could not open socket!\n");
+        return 2;
+    }
+    memset((char *) &si, 0, sizeof(si));
+    si.sin_family = AF_INET;
+    si.sin_port = htons(port);
+    si.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (bind(s, (struct sockaddr *)&si, sizeof(si)) == -1) {
+        fprintf(stderr, "Could not bind to port!\n");
+        close(s);
+        return 2;
+    }
+
+    // pcap file header
+    write32(0xA1B2C3D4); // Magic
+    write32(0x00040002); // Version 2.4
+    write32(0); // Timezone
+    write32(0); // Timestamp accuracy
+    write32(65535); // Snap length, the device tells us per record
+    write32(1); // Ethernet
+    fflush(out);
+
+    fprintf(stderr, "Waiting for captured frames on Port %d\nStop with CTRL+C...\n", port);
+    while ((sz = recv(s, buffer, BUFFSIZE, 0)) > 0) {
+        // Only write complete records
+        for (i = 0; (i + 16) <= sz; i += 16 + length) {
+            length = read32(buffer + i + 8);
+            if ((i + 16 + length) > sz) {
+                fprintf(stderr, "Truncated record!\n");
+                break;
+            }
+            fwrite(buffer + i, 1, 16 + length, out);
+            frames++;
+        }
+        fflush(out);
+    }
+    close(s);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s file [port]\n", argv[0]);
+        fprintf(stderr, "       %s file -s device [baud]\n", argv[0]);
+        return 1;
+    }
+
+    if (strcmp(argv[1], "-") == 0) {
+        out = stdout;
+    } else if ((out = fopen(argv[1], "wb")) == NULL) {
+        fprintf(stderr, "Could not open %s!\n", argv[1]);
+        return 2;
+    }
+
+    signal(SIGINT, intHandler);
+    signal(SIGQUIT, intHandler);
+
+    if ((argc >= 4) && (strcmp(argv[2], "-s") == 0)) {
+        return receiveSerial(argv[3], (argc >= 5) ? baudRate(atoi(argv[4])) : BAUD);
+    }
+    return receiveUdp((argc >= 3) ? atoi(argv[2]) : PORT);
+}
+
+void intHandler(int dummy) {
+    fprintf(stderr, " Exiting (%lu frames)...\n", frames);
+    if (s != -1) {
+        close(s);
+    }
+    fclose(out);
+    exit(0);
+}
@@ -32,12 +32,15 @@
 #include <stdlib.h>
 #include <avr/interrupt.h>
 #include <avr/wdt.h>
+#include <avr/pgmspace.h>
 
+#define HEAP_TAG HEAP_TAG_APP
 #include <std.h>
 #include <time.h>
 #include <serial.h>
 #include <scheduler.h>
 #include <tasks.h>
+#include <coroutine.h>
 
 #include <net/mac.h>
 #include <net/ipv4.h>
@@ -46,12 +49,17 @@
 #include <net/ntp.h>
 #include <net/arp.h>
 #include <net/udp.h>
+#include <net/stats.h>
+#include <net/capture.h>
 #include <net/controller.h>
 
 char *getString(uint8_t id);
 void printArpTable(void);
+void printTaskStats(void);
 void heartbeat(void);
+void stackLow(uint16_t unused);
 void serialHandler(void);
+uint8_t serialHasCommand(void);
 
 uint8_t mac[6] = {0x00, 0x04, 0xA3, 0x00, 0x00, 0x00};
 IPv4Address defIp = {192, 168, 0, 42};
@@ -60,12 +68,25 @@ IPv4Address defGateway = {192, 168, 0, 1};
 
 IPv4Address testIp = {192, 168, 0, 103};
 #define TESTPORT 6600
+#define CAPTUREPORT 6601 // pcapReceiver listens here
 
-uint8_t pingState = 0, pingMode = 0;
-time_t pingTime, responseTime;
+const uint8_t helloWorld[12] PROGMEM = "Hello World.";
+PacketSegment helloSegment = { helloWorld, sizeof(helloWorld), SEGMENT_FLASH, NULL };
+
+uint8_t pingState = 0, pingMode = 0, pingInput = 0;
+uint32_t pingTime, responseTime; // us, responseTime is 0 until a reply arrived
+Coroutine pingCoroutine;
 IPv4Address pingIpA = {192, 168, 0, 103};
 IPv4Address pingIpB = {80, 150, 6, 143};
 
+STATIC_TASKS(testTasks,
+    TASK(serialHandler, serialHasCommand, "Serial", TASK_PRIORITY_NORMAL) // Execute Serial Handler if char received
+);
+
+STATIC_TIMERS(testTimers,
+    TIMER(heartbeat, 500, 500) // Toggle LED every 500ms
+);
+
 uint8_t mcusr_mirror __attribute__ ((section(".noinit")));
 void mirrorWatchdog(void) __attribute__((naked)) __attribute__((section(".init3")));
 void mirrorWatchdog(void) {
@@ -89,7 +110,7 @@ int main(void) {
 
     wdt_enable(WDTO_2S);
 
-    networkInit(mac, defIp, defSubnet, defGateway);
+    networkInit(&MACDRIVER, mac, defIp, defSubnet, defGateway);
 
     serialWriteString(getString(0)); // avrNetStack-Debug
     serialWriteString(getString(1)); //  initialized!\n
@@ -111,8 +132,9 @@ int main(void) {
 
     PORTA &= ~((1 << PA7) | (1 << PA6)); // LEDs off
 
-    addTimedTask(heartbeat, 500, 1); // Toggle LED every 500ms
-    addTask(serialHandler, serialHasChar, "Serial"); // Execute Serial Handler if char received
+    stackSetAlarm(STACK_ALARM, stackLow);
+    startStaticTimers(testTimers);
+    registerStaticTasks(testTasks);
 
     while (1)
         networkLoop(); // Runs task manager and scheduler, resets watchdog timer for us
@@ -143,80 +165,262 @@ void printArpTable(void) {
     }
 }
 
+#ifndef DISABLE_TASK_PROFILING
+void printStats(TaskStats *s) {
+    serialWriteString(getString(7)); // ": "
+    serialWriteString(timeToString(s->calls));
+    serialWriteString(getString(43)); // " calls"
+    serialWriteString(getString(25)); // ", "
+    serialWriteString(timeToString(s->time));
+    serialWriteString(getString(18)); // " us"
+    serialWriteString(getString(25)); // ", "
+    serialWriteString(getString(44)); // "max "
+    serialWriteString(timeToString(s->max));
+    serialWriteString(getString(18)); // " us"
+}
+
+void printTaskStats(void) {
+    uint8_t i;
+    char *name;
+    Task func;
+    TaskStats *s;
+    for (i = 0; (s = taskGetStats(i, &name)) != NULL; i++) {
+        serialWriteString((name != NULL) ? name : "?");
+        printStats(s);
+        serialWrite('\n');
+    }
+    for (i = 0; (s = timerGetStats(i, &func)) != NULL; i++) {
+        serialWriteString(getString(46)); // "Timer "
+        serialWriteString(hexToString((uint16_t)func));
+        printStats(s);
+        serialWriteString(getString(25)); // ", "
+        serialWriteString(timeToString(s->late));
+        serialWriteString(getString(45)); // " ms late"
+        serialWrite('\n');
+    }
+}
+#endif
+
+#ifndef DISABLE_HEAP
+void printHeap(void) {
+#ifndef DISABLE_HEAP_LOG
+    serialWriteString(timeToString(heapBytesAllocated));
+    serialWrite('/');
+    serialWriteString(timeToString(HEAPSIZE));
+    serialWriteString(getString(4)); // " bytes "
+    serialWriteString(getString(6)); // "allocated\n"
+    serialWriteString(getString(55)); // "Heap"
+    serialWriteString(getString(7)); // ": "
+    serialWriteString(timeToString(heapBytesPeak));
+    serialWriteString(getString(49)); // " max"
+    serialWriteString(getString(25)); // ", "
+    serialWriteString(timeToString(heapFailures));
+    serialWriteString(getString(50)); // " failed"
+    serialWriteString(getString(25)); // ", "
+#else
+    serialWriteString(getString(55)); // "Heap"
+    serialWriteString(getString(7)); // ": "
+#endif
+    serialWriteString(timeToString(heapLargestFree()));
+    serialWriteString(getString(56)); // " free"
+    serialWrite('\n');
+#ifndef DISABLE_HEAP_LOG
+    // Everything still listed here has not been freed
+    for (uint8_t i = 0; i < HEAPSITES; i++) {
+        if (heapSites[i].count == 0) {
+            continue;
+        }
+        serialWriteString(getString(55)); // "Heap"
+        serialWrite(' ');
+        serialWriteString(timeToString(heapSites[i].tag));
+        serialWrite(':');
+        serialWriteString(timeToString(heapSites[i].line)); // 0 for the rest
+        serialWriteString(getString(7)); // ": "
+        serialWriteString(timeToString(heapSites[i].count));
+        serialWriteString(getString(48)); // " used"
+        serialWriteString(getString(25)); // ", "
+        serialWriteString(timeToString(heapSites[i].bytes));
+        serialWriteString(getString(4)); // " bytes "
+        serialWrite('\n');
+    }
+#endif
+}
+#endif
+
+void printStack(void) {
+    serialWriteString(getString(57)); // "Stack"
+    serialWriteString(getString(7)); // ": "
+    serialWriteString(timeToString(stackUnusedBytes()));
+    serialWriteString(getString(56)); // " free"
+    serialWriteString(getString(25)); // ", "
+    serialWriteString(timeToString(stackMinFree));
+    serialWriteString(getString(58)); // " min"
+    serialWrite('\n');
+}
+
+void stackLow(uint16_t unused) {
+    serialWriteString(getString(59)); // "Stack low: "
+    serialWriteString(timeToString(unused));
+    serialWriteString(getString(56)); // " free"
+    serialWrite('\n');
+}
+
+void printCounters(uint8_t string, uint16_t *c, uint8_t count) {
+    serialWriteString(getString(string));
+    for (uint8_t i = 0; i < count; i++) {
+        serialWriteString(timeToString(c[i]));
+        serialWrite(((i + 1) < count) ? '/' : '\n');
+    }
+}
+
+#ifndef DISABLE_NET_STATS
+#define printLayer(s, l) printCounters(s, (uint16_t *)&netStats.l, \
+        sizeof(netStats.l) / sizeof(uint16_t))
+
+void printNetStats(void) {
+    printLayer(60, mac);
+    printLayer(61, ipv4);
+    printLayer(62, arp);
+    printLayer(63, icmp);
+    printLayer(64, udp);
+}
+#endif
+
+void printPacketPools(void) {
+    for (uint8_t i = 0; i < PACKETPOOLS; i++) {
+        PacketPool *c = &packetPools[i];
+        serialWriteString(getString(47)); // "Packets "
+        serialWriteString(timeToString(c->size));
+        serialWriteString(getString(7)); // ": "
+        serialWriteString(timeToString(c->count - c->available));
+        serialWrite('/');
+        serialWriteString(timeToString(c->count));
+        serialWriteString(getString(48)); // " used"
+        serialWriteString(getString(25)); // ", "
+        serialWriteString(timeToString(c->count - c->minAvailable));
+        serialWriteString(getString(49)); // " max"
+        serialWriteString(getString(25)); // ", "
+        serialWriteString(timeToString(c->exhausted));
+        serialWriteString(getString(50)); // " failed"
+        serialWrite('\n');
+    }
+    serialWriteString(getString(47)); // "Packets "
+    serialWrite('>');
+    serialWriteString(timeToString(PacketMaxLength));
+    serialWriteString(getString(7)); // ": "
+    serialWriteString(timeToString(packetTooBig));
+    serialWriteString(getString(50)); // " failed"
+    serialWrite('\n');
+}
+
+void printSlab(uint8_t name, Slab *s) {
+    serialWriteString(getString(51)); // "Slab"
+    serialWriteString(getString(name));
+    serialWriteString(getString(7)); // ": "
+    serialWriteString(timeToString(s->used));
+    serialWrite('/');
+    serialWriteString(timeToString(s->count));
+    serialWriteString(getString(48)); // " used"
+    serialWriteString(getString(25)); // ", "
+    serialWriteString(timeToString(s->peak));
+    serialWriteString(getString(49)); // " max"
+    serialWriteString(getString(25)); // ", "
+    serialWriteString(timeToString(s->fails));
+    serialWriteString(getString(50)); // " failed"
+    serialWrite('\n');
+}
+
+void printSlabs(void) {
+    printSlab(52, &arpSlab); // " ARP"
+    printSlab(53, &ipv4QueueSlab); // " IPv4"
+    printSlab(54, &udpHandlerSlab); // " UDP"
+    printSlab(14, &taskSlab); // " Tasks"
+    printSlab(16, &timerSlab); // " Scheduler"
+}
+
 void heartbeat(void) {
     PORTA ^= (1 << PA6); // Toggle LED
 }
 
 void pingInterrupt(Packet *p) {
-    responseTime = getSystemTime();
-    mfree(p->d, p->dLength);
-    mfree(p, sizeof(Packet));
+    responseTime = p->time;
+    packetRelease(p);
+    crWake(); // pingThread waits for this
+}
 
-    serialWriteString(getString(19)); // "RoundTripTime"
-    serialWriteString(getString(7)); // ": "
-    serialWriteString(timeToString(diffTime(pingTime, responseTime)));
-    serialWriteString(getString(18)); // " ms"
-    serialWrite('\n');
+uint8_t pingThread(Coroutine *cr) {
+    uint8_t c;
 
-    pingState--;
-    if (pingState == 0) {
-        // Finished pinging
-        registerEchoReplyHandler(NULL);
+    CR_BEGIN(cr);
+    // The serial handler ignores chars while we wait for them
+    pingInput = 1;
+    serialWriteString(getString(30)); // "(1)Internal or (2)External?\n"
+    CR_WAIT_UNTIL(cr, serialHasChar());
+    c = serialGet();
+    if (c == '1') {
+        pingMode = 0;
+    } else if (c == '2') {
+        pingMode = 1;
     } else {
-        // Ping again
+        serialWriteString(getString(34)); // "Invalid!\n"
+        pingInput = 0;
+        CR_EXIT(cr);
+    }
+    serialWriteString(getString(33)); // "How many times? (0 - 9)\n"
+    CR_WAIT_UNTIL(cr, serialHasChar());
+    c = serialGet();
+    pingInput = 0;
+    if ((c < '0') || (c > '9')) {
+        serialWriteString(getString(34)); // "Invalid!\n"
+        CR_EXIT(cr);
+    }
+
+    pingState = c - '0';
+    registerEchoReplyHandler(pingInterrupt);
+    while (pingState > 0) {
+        responseTime = 0;
         if (pingMode) {
             sendEchoRequest(pingIpB);
         } else {
             sendEchoRequest(pingIpA);
         }
-        pingTime = getSystemTime();
+        pingTime = getSystemTimeUs();
+        CR_WAIT_TIMEOUT(cr, responseTime != 0, 2000);
+        if (CR_TIMED_OUT(cr)) {
+            serialWriteString(getString(31)); // "Timed out :(\n"
+            break;
+        }
+        serialWriteString(getString(19)); // "RoundTripTime"
+        serialWriteString(getString(7)); // ": "
+        serialWriteString(timeToString(responseTime - pingTime));
+        serialWriteString(getString(18)); // " us"
+        serialWrite('\n');
+        pingState--;
     }
+    pingState = 0;
+    registerEchoReplyHandler(NULL);
+    CR_END(cr);
 }
 
 void pingTool(void) {
-    uint8_t c;
-    if (pingState) {
-        // Check if we got a timeout
-        if (diffTime(getSystemTime(), pingTime) > 2000) {
-            serialWriteString(getString(31)); // "Timed out :(\n"
-            pingState = 0;
-            registerEchoReplyHandler(NULL);
-        } else {
-            serialWriteString(getString(32)); // "Hasn't timed out yet!\n"
-        }
+    if (crIsRunning(&pingCoroutine)) {
+        serialWriteString(getString(32)); // "Hasn't timed out yet!\n"
     } else {
-        // Send an Echo Request
-        serialWriteString(getString(30)); // "(1)Internal or (2)External?\n"
-        while (!serialHasChar()) { wdt_reset(); }
-        c = serialGet();
-        if (c == '1') {
-            pingMode = 0;
-        } else if (c == '2') {
-            pingMode = 1;
-        } else {
-            serialWriteString(getString(34)); // "Invalid!\n"
-            return;
-        }
-        serialWriteString(getString(33)); // "How many times? (0 - 9)\n"
-        while (!serialHasChar()) { wdt_reset(); }
-        c = serialGet();
-        if ((c >= '0') && (c <= '9')) {
-            pingState = c - '0';
-            registerEchoReplyHandler(pingInterrupt);
-            if (pingMode) {
-                sendEchoRequest(pingIpB);
-            } else {
-                sendEchoRequest(pingIpA);
-            }
-            pingTime = getSystemTime();
-            responseTime = 0;
-        } else {
-            serialWriteString(getString(34)); // "Invalid!\n"
-            return;
-        }
+        crStart(&pingCoroutine, pingThread);
     }
 }
 
+uint8_t serialHasCommand(void) {
+    if (!serialHasChar()) {
+        return 0;
+    }
+    if (pingInput) {
+        crWake(); // pingThread waits for this char
+        return 0;
+    }
+    return 1;
+}
+
 void serialHandler(void) {
     uint8_t i, j, k, l, m;
     uint16_t n;
@@ -227,12 +431,12 @@ void serialHandler(void) {
     serialWriteString(getString(7)); // ": "
     switch(c) {
         case 'r':
-            macInitialize(mac);
+            netInterfaces[0].driver->initialize(mac);
             serialWriteString(getString(40)); // "MAC reinitialized!\n"
             break;
         case 'i':
             serialWriteString(getString(15)); // "Pin is "
-            if (!macHasInterrupt()) {
+            if (!netInterfaces[0].driver->hasInterrupt()) {
                 serialWriteString(getString(41)); // "High"
             } else {
                 serialWriteString(getString(42)); // "Low"
@@ -240,7 +444,7 @@ void serialHandler(void) {
             serialWrite('\n');
             break;
         case 't': // Time
-            convertTimestamp(getSystemTimeSeconds(), &n, &m, &l, &k, &j, &i);
+            convertTimestamp(getUnixTime(), &n, &m, &l, &k, &j, &i);
             serialWriteString(timeToString(l)); // day
             serialWrite('.');
             serialWriteString(timeToString(m)); // month
@@ -264,13 +468,14 @@ void serialHandler(void) {
             serialWriteString(timeToString(schedulerRegistered()));
             serialWriteString(getString(16)); // " Scheduler"
             serialWrite('\n');
-            serialWriteString(timeToString(heapBytesAllocated));
-            serialWrite('/');
-            serialWriteString(timeToString(HEAPSIZE));
-            serialWriteString(getString(4)); // " bytes "
-            serialWriteString(getString(6)); // "allocated\n"
+#ifndef DISABLE_HEAP
+            printHeap();
+#endif
+            printStack();
             serialWriteString(timeToString(ipv4PacketsInQueue()));
             serialWriteString(getString(36)); // " IPv4 Packets in Queue\n"
+            printPacketPools();
+            printSlabs();
             serialWriteString(timeToString(udpRegisteredHandlers));
             serialWrite(' ');
             serialWriteString(getString(38)); // "UDP"
@@ -279,26 +484,8 @@ void serialHandler(void) {
             break;
 
         case 'u': // Send UDP Packet to testIp
-            if ((p = (Packet *)mmalloc(sizeof(Packet))) != NULL) {
-                p->dLength = UDPOffset + UDPDataOffset + 12; // "Hello World."
-                p->d = (uint8_t *)mmalloc(p->dLength);
-                if (p->d == NULL) {
-                    serialWriteString(getString(26)); // "Not enough memory!\n"
-                    mfree(p, sizeof(Packet));
-                    break;
-                }
-                p->d[UDPOffset + UDPDataOffset + 0] = 'H';
-                p->d[UDPOffset + UDPDataOffset + 1] = 'e';
-                p->d[UDPOffset + UDPDataOffset + 2] = 'l';
-                p->d[UDPOffset + UDPDataOffset + 3] = 'l';
-                p->d[UDPOffset + UDPDataOffset + 4] = 'o';
-                p->d[UDPOffset + UDPDataOffset + 5] = ' ';
-                p->d[UDPOffset + UDPDataOffset + 6] = 'W';
-                p->d[UDPOffset + UDPDataOffset + 7] = 'o';
-                p->d[UDPOffset + UDPDataOffset + 8] = 'r';
-                p->d[UDPOffset + UDPDataOffset + 9] = 'l';
-                p->d[UDPOffset + UDPDataOffset + 10] = 'd';
-                p->d[UDPOffset + UDPDataOffset + 11] = '.';
+            if ((p = udpAllocPacket(0)) != NULL) {
+                packetAppend(p, &helloSegment); // Sent directly from Flash
                 serialWriteString(getString(27)); // "Packet sent"
                 serialWriteString(getString(7)); // ": "
                 serialWriteString(timeToString(udpSendPacket(p, testIp, TESTPORT, TESTPORT)));
@@ -308,11 +495,13 @@ void serialHandler(void) {
             }
             break;
 
-        case 'l': // Link Status
-            if (macLinkIsUp()) {
-                serialWriteString(getString(3));
-            } else {
-                serialWriteString(getString(2));
+        case 'l': // Link Status, one line per interface
+            for (i = 0; i < netInterfaceCount; i++) {
+                if (netInterfaces[i].driver->linkIsUp()) {
+                    serialWriteString(getString(3));
+                } else {
+                    serialWriteString(getString(2));
+                }
             }
             break;
 
@@ -320,6 +509,31 @@ void serialHandler(void) {
             printArpTable();
             break;
 
+#ifndef DISABLE_CAPTURE
+        case 'w': // Toggle capture to testIp
+            if (!captureActive) {
+                captureStart(CAPTURE_UDP, NULL, 0, testIp, CAPTUREPORT);
+                serialWriteString(getString(65)); // "Capture started\n"
+            } else {
+                captureStop();
+                printCounters(66, (uint16_t *)&captureStats,
+                        sizeof(captureStats) / sizeof(uint16_t));
+            }
+            break;
+#endif
+
+#ifndef DISABLE_NET_STATS
+        case 'o': // Packet Counters
+            printNetStats();
+            break;
+#endif
+
+#ifndef DISABLE_TASK_PROFILING
+        case 'c': // Task Statistics
+            printTaskStats();
+            break;
+#endif
+
 #ifndef DISABLE_NTP
         case 'n': // Send NTP Request
             i = ntpIssueRequest();
@@ -45,7 +45,7 @@ const char string6[] PROGMEM = "allocated\n";
 const char string7[] PROGMEM = ": ";
 const char string8[] PROGMEM = "NTP Request: ";
 const char string9[] PROGMEM = "DHCP Request: ";
-const char string10[] PROGMEM = "Commands: (h)elp, (q)uit, (l)ink,\n  (v)ersion, (s)tatus, (a)rp, (n)tp,\n  (d)hcp, (u)dp, (p)ing, (t)ime\n  (r)eset, (i)nt\n";
+const char string10[] PROGMEM = "Commands: (h)elp, (q)uit, (l)ink,\n  (v)ersion, (s)tatus, (a)rp, (n)tp,\n  (d)hcp, (u)dp, (p)ing, (t)ime\n  (r)eset, (i)nt, (c)pu, c(o)unters\n  (w)ireshark\n";
 const char string11[] PROGMEM = "Good Bye...\n\n";
 const char string12[] PROGMEM = "ARP Table:\n";
 const char string13[] PROGMEM = " --> ";
@@ -53,7 +53,7 @@ const char string14[] PROGMEM = " Tasks";
 const char string15[] PROGMEM = "Pin is ";
 const char string16[] PROGMEM = " Scheduler";
 const char string17[] PROGMEM = "Trying to connect...\n";
-const char string18[] PROGMEM = " ms";
+const char string18[] PROGMEM = " us";
 const char string19[] PROGMEM = "RoundTripTime";
 const char string20[] PROGMEM = "Power-On Reset";
 const char string21[] PROGMEM = "External Reset";
@@ -78,9 +78,33 @@ const char string39[] PROGMEM = " Handlers registered\n";
 const char string40[] PROGMEM = "MAC reinitialized!\n";
 const char string41[] PROGMEM = "High";
 const char string42[] PROGMEM = "Low";
+const char string43[] PROGMEM = " calls";
+const char string44[] PROGMEM = "max ";
+const char string45[] PROGMEM = " ms late";
+const char string46[] PROGMEM = "Timer ";
+const char string47[] PROGMEM = "Packets ";
+const char string48[] PROGMEM = " used";
+const char string49[] PROGMEM = " max";
+const char string50[] PROGMEM = " failed";
+const char string51[] PROGMEM = "Slab";
+const char string52[] PROGMEM = " ARP";
+const char string53[] PROGMEM = " IPv4";
+const char string54[] PROGMEM = " UDP";
+const char string55[] PROGMEM = "Heap";
+const char string56[] PROGMEM = " free";
+const char string57[] PROGMEM = "Stack";
+const char string58[] PROGMEM = " min";
+const char string59[] PROGMEM = "Stack low: ";
+const char string60[] PROGMEM = "MAC rx/tx/rxError/txError/noHandler/shed/rxStalled: ";
+const char string61[] PROGMEM = "IPv4 rx/tx/invalid/checksum/fragment/notForUs/noHandler/unresolved/queueFull/unreachable:\n  ";
+const char string62[] PROGMEM = "ARP rx/tx/invalid/notForUs/noMemory/shed: ";
+const char string63[] PROGMEM = "ICMP rx/tx/invalid/checksum/noMemory/shed: ";
+const char string64[] PROGMEM = "UDP rx/tx/invalid/checksum/noHandler: ";
+const char string65[] PROGMEM = "Capture started\n";
+const char string66[] PROGMEM = "Capture captured/dropped/sendFailed: ";
 
 // Last index + 1
-#define STRINGNUM 43
+#define STRINGNUM 67
 
 PGM_P const stringTable[STRINGNUM] PROGMEM = {
     string0, string1, string2, string3, string4,
@@ -91,7 +115,12 @@ PGM_P const stringTable[STRINGNUM] PROGMEM = {
     string25, string26, string27, string28, string29,
     string30, string31, string32, string33, string34,
     string35, string36, string37, string38, string39,
-    string40, string41, string42
+    string40, string41, string42, string43, string44,
+    string45, string46, string47, string48, string49,
+    string50, string51, string52, string53, string54,
+    string55, string56, string57, string58, string59,
+    string60, string61, string62, string63, string64,
+    string65, string66
 };
 
 const char stringNotFoundError[] PROGMEM = "String not found!\n";